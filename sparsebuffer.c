@@ -14,37 +14,820 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SB_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SB_POSIX 1
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#if defined(__GNUC__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SB_IO_URING 1
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+#endif
+
+#if defined(SB_POSIX) && defined(__GNUC__)
+#define SB_EPOCH 1
+#include <sched.h>
+#endif
+
 #include "sparsebuffer.h"
 
+/* Fills and copies of at least this many bytes bypass the cache by default. */
+#define DEFAULT_STREAM_THRESHOLD (1 << 20)
+
+/* The most pieces a copy is split into, for sb_set_parallel_copy(). */
+#define MAX_PARALLEL_WORKERS 256
+
+#if defined(__GNUC__)
+#define ATOMIC_LOAD(ptr)       __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define ATOMIC_ADD(ptr, val)   __atomic_add_fetch(ptr, val, __ATOMIC_ACQ_REL)
+#define ATOMIC_SUB(ptr, val)   __atomic_sub_fetch(ptr, val, __ATOMIC_ACQ_REL)
+#else
+#define ATOMIC_LOAD(ptr)       (*(ptr))
+#define ATOMIC_STORE(ptr, val) (*(ptr) = (val))
+#define ATOMIC_ADD(ptr, val)   (*(ptr) += (val))
+#define ATOMIC_SUB(ptr, val)   (*(ptr) -= (val))
+#endif
+
 typedef struct Range {
     struct Range *prev;
     struct Range *next;
     size_t pos;
     size_t size;
     uint8_t *data;
+    uint32_t crc; /* Cached CRC32C of the whole range, if crc_valid. */
+    bool crc_valid;
+    uint64_t used; /* The spill clock when the range was last read or loaded. */
 } Range;
 
-typedef struct SBReader {
+/* A free extent of a spill file, which later spills reuse. */
+typedef struct SpillHole {
+    struct SpillHole *next;
+    uint64_t off;
+    uint64_t len;
+} SpillHole;
+
+/* A temporary file which cold range data is spilled to, kept until no data uses it. */
+typedef struct SpillFile {
+    size_t refs;
+    int fd;
+    uint64_t end;
+    SpillHole *holes; /* Sorted by offset, and never touching each other or the end. */
+#if defined(SB_POSIX)
+    pthread_mutex_t lock; /* Protects end and holes, since data may be freed on any thread. */
+#endif
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+} SpillFile;
+
+/*
+ * Range data is preceded by a count of the ranges using it, since snapshots and
+ * clones share it, and where it was spilled to, if it was. It always lives in
+ * anonymous memory, even for spilled data, so that sharing never dirties the file.
+ */
+typedef struct DataHeader {
+    size_t refs;
+    SpillFile *spill;
+    uint64_t spill_off;
+    size_t spill_len;
+} DataHeader;
+
+/* The space taken by a data header, padded to keep the data as aligned as the allocation. */
+#define DATA_ALIGN       16
+#define DATA_HEADER_SIZE ((sizeof(DataHeader) + DATA_ALIGN - 1) & ~(size_t) (DATA_ALIGN - 1))
+
+/* C99 has neither alignof nor static assertions, so check the padding through an array size. */
+#define ALIGN_OF(type) offsetof(struct { char c; type x; }, x)
+typedef char data_header_aligned[DATA_HEADER_SIZE % ALIGN_OF(long double) == 0 &&
+                                 DATA_HEADER_SIZE % ALIGN_OF(uint64_t) == 0 &&
+                                 DATA_HEADER_SIZE % ALIGN_OF(void *) == 0 ? 1 : -1];
+
+/*
+ * A read-only mapping of a file, which ranges loaded with sb_load_mapped() point into
+ * instead of owning their data. Shared by snapshots and clones, like the ranges.
+ */
+typedef struct FileMap {
+    size_t refs;
+    uint8_t *base;
+    size_t size;
+} FileMap;
+
+/* A loaded (data != NULL) or unloaded span of a reader. */
+typedef struct Extent {
     size_t pos;
     size_t size;
+    const uint8_t *data;
+} Extent;
+
+/* An immutable copy of the ranges of a reader, published for lock-free reads. */
+typedef struct Version {
+    size_t size;
+    size_t count;
+    size_t max;
+    Extent ext[];
+} Version;
+
+/* The number of lock-free readers in each of the last two epochs. Stripes are a cache line apart. */
+#define EPOCH_STRIPE_BITS 6
+#define EPOCH_STRIPES     (1 << EPOCH_STRIPE_BITS)
+typedef struct EpochStripe {
+    uint64_t active[2];
+    uint8_t pad[48];
+} EpochStripe;
+
+#if defined(SB_POSIX)
+/* A thread blocked in sb_read_wait(), until [start, end) of its root reader is loaded. */
+typedef struct Waiter {
+    struct Waiter *prev;
+    struct Waiter *next;
+    size_t start;
+    size_t end;
+    pthread_cond_t cond;
+} Waiter;
+#endif
+
+/* A registered interest in [start, end) of a root reader being loaded. */
+typedef struct Notify {
+    struct Notify *prev;
+    struct Notify *next;
+    size_t start;
+    size_t end;
+    void (*func)(void *opaque);
+    void *opaque;
+} Notify;
+
+typedef struct SBReader {
+    SBWindow win; /* Read from and advanced directly by the inline readers in sparsebuffer.h. */
+    size_t size;
     Range *ranges;
+    size_t *ranges_refs; /* The number of readers sharing ranges, if it is shared. */
+    bool read_only;
+    FileMap *map;
+
+    /* Cold range data is spilled once more than spill_limit bytes are held in memory. */
+    SpillFile *spill;
+    size_t spill_limit;
+    uint64_t spill_clock;
+    uint64_t gen; /* Bumped whenever ranges change, invalidating saved range hints. */
+    int flags;
+
+    /*
+     * Only used by root readers, and by views through them. Copies and fills of at least
+     * stream_threshold bytes bypass the cache, and copies of at least parallel_threshold
+     * bytes are split across workers.
+     */
+    size_t stream_threshold;
+    size_t parallel_threshold;
+    size_t parallel_workers;
+    void (*parallel_run)(void *pool, void (*task)(void *arg, size_t i), void *arg, size_t n);
+    void *parallel_pool;
+    struct WorkerPool *pool; /* Threads for parallel copies without a user pool, once needed. */
+#if defined(SB_POSIX)
+    /* Only used by thread-safe readers. */
+    pthread_rwlock_t lock;
+    pthread_mutex_t wait_lock; /* Taken before lock, and protects waiters and notifications. */
+    pthread_mutex_t pos_lock;  /* Taken after lock, last, and protects the position. */
+    Waiter *waiters;
+#endif
+
+    /* Pending notifications, and those without a callback which are ready to be taken. */
+    Notify *notifies;
+    Notify *ready;
+    Notify *ready_tail;
+    int event_fd;  /* Readable while ready is not empty, or -1. */
+    int event_wfd; /* The end to signal it through. */
+
+    /* Only used by readers with lock-free reads. */
+    Version *version;
+    Version *spare; /* The previous version, which no reader can still be using. */
+    uint64_t epoch;
+    EpochStripe *stripes;
+    uint8_t **retired; /* Uses of range data dropped since the last version was published. */
+    size_t nretired;
+    size_t retired_max;
+
+    /* Views share their root's ranges, and start at base in it. */
+    struct SBReader *parent;
+    size_t base;
+    struct SBReader *views;
+    struct SBReader *prev_view;
+    struct SBReader *next_view;
     void *(*malloc)(size_t size);
     void *(*realloc)(void *ptr, size_t size);
     void (*free)(void *ptr);
 } SBReader;
 
+/* Shard i covers [i * shard_size, (i + 1) * shard_size) of a sharded reader. */
+typedef struct SBShardedReader {
+    size_t size;
+    size_t shard_size;
+    size_t count;
+    SBReader **shards;
+    void (*free)(void *ptr);
+} SBShardedReader;
+
+/*
+ * Memory copies and fills.
+ */
+
+#if defined(SB_X86_SIMD)
+/* Zeroes with non-temporal stores, so large fills do not evict the cache. */
+__attribute__((target("sse2")))
+static void zero_stream_sse2(uint8_t *dst, size_t n)
+{
+    size_t head = (16 - ((uintptr_t) dst & 15)) & 15;
+    if (head > n)
+        head = n;
+    memset(dst, 0, head);
+    dst += head;
+    n   -= head;
+
+    const __m128i zero = _mm_setzero_si128();
+    for (; n >= 64; dst += 64, n -= 64) {
+        _mm_stream_si128((__m128i *) dst, zero);
+        _mm_stream_si128((__m128i *) (dst + 16), zero);
+        _mm_stream_si128((__m128i *) (dst + 32), zero);
+        _mm_stream_si128((__m128i *) (dst + 48), zero);
+    }
+    _mm_sfence();
+
+    memset(dst, 0, n);
+}
+#endif
+
+#if defined(SB_X86_SIMD)
+/*
+ * Copies with non-temporal stores, so large copies do not evict the cache. The
+ * destination is aligned to the vector size, and the source is loaded unaligned.
+ */
+__attribute__((target("avx512f")))
+static void copy_stream_avx512(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t head = (64 - ((uintptr_t) dst & 63)) & 63;
+    if (head > n)
+        head = n;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n   -= head;
+
+    for (; n >= 256; dst += 256, src += 256, n -= 256) {
+        __m512i a = _mm512_loadu_si512((const void *) src);
+        __m512i b = _mm512_loadu_si512((const void *) (src + 64));
+        __m512i c = _mm512_loadu_si512((const void *) (src + 128));
+        __m512i d = _mm512_loadu_si512((const void *) (src + 192));
+        _mm512_stream_si512((void *) dst, a);
+        _mm512_stream_si512((void *) (dst + 64), b);
+        _mm512_stream_si512((void *) (dst + 128), c);
+        _mm512_stream_si512((void *) (dst + 192), d);
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void copy_stream_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t head = (32 - ((uintptr_t) dst & 31)) & 31;
+    if (head > n)
+        head = n;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n   -= head;
+
+    for (; n >= 128; dst += 128, src += 128, n -= 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) src);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *) (src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (src + 96));
+        _mm256_stream_si256((__m256i *) dst, a);
+        _mm256_stream_si256((__m256i *) (dst + 32), b);
+        _mm256_stream_si256((__m256i *) (dst + 64), c);
+        _mm256_stream_si256((__m256i *) (dst + 96), d);
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, n);
+}
+
+__attribute__((target("sse2")))
+static void copy_stream_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t head = (16 - ((uintptr_t) dst & 15)) & 15;
+    if (head > n)
+        head = n;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n   -= head;
+
+    for (; n >= 64; dst += 64, src += 64, n -= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *) src);
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+        _mm_stream_si128((__m128i *) dst, a);
+        _mm_stream_si128((__m128i *) (dst + 16), b);
+        _mm_stream_si128((__m128i *) (dst + 32), c);
+        _mm_stream_si128((__m128i *) (dst + 48), d);
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, n);
+}
+#endif
+
+/* Copies n bytes from src to dst, bypassing the cache above the reader's streaming threshold. */
+static void copy_block(SBReader *reader, uint8_t *dst, const uint8_t *src, size_t n)
+{
+#if defined(SB_X86_SIMD)
+    SBReader *root = reader->parent != NULL ? reader->parent : reader;
+
+    if (root->stream_threshold != 0 && n >= root->stream_threshold) {
+        if (__builtin_cpu_supports("avx512f")) {
+            copy_stream_avx512(dst, src, n);
+            return;
+        } else if (__builtin_cpu_supports("avx2")) {
+            copy_stream_avx2(dst, src, n);
+            return;
+        } else if (__builtin_cpu_supports("sse2")) {
+            copy_stream_sse2(dst, src, n);
+            return;
+        }
+    }
+#else
+    (void) reader;
+#endif
+
+    memcpy(dst, src, n);
+}
+
+/* One piece of a copy split across workers. */
+typedef struct CopyTask {
+    SBReader *reader;
+    uint8_t *dst;
+    const uint8_t *src;
+    size_t n;
+    size_t chunk;
+} CopyTask;
+
+static void copy_task(void *arg, size_t i)
+{
+    CopyTask *t = arg;
+    size_t off  = i * t->chunk;
+    size_t n    = t->n - off < t->chunk ? t->n - off : t->chunk;
+
+    copy_block(t->reader, t->dst + off, t->src + off, n);
+}
+
+#if defined(SB_POSIX)
+/*
+ * Threads kept by a root reader to run the pieces of its parallel copies. Threads are
+ * only added, and all of them are stopped when the reader is freed.
+ */
+typedef struct WorkerPool {
+    pthread_mutex_t lock;
+    pthread_cond_t start; /* Signalled when a copy is started, or the pool is stopped. */
+    pthread_cond_t done;  /* Signalled when the last piece of a copy has finished. */
+    void (*task)(void *arg, size_t i); /* The running copy, or NULL if there is none. */
+    void *arg;
+    size_t n;
+    size_t next;
+    size_t finished;
+    bool stop;
+    size_t nthreads;
+    pthread_t threads[MAX_PARALLEL_WORKERS];
+} WorkerPool;
+
+static void *worker_main(void *arg)
+{
+    WorkerPool *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && (p->task == NULL || p->next == p->n))
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->stop)
+            break;
+
+        void (*task)(void *arg, size_t i) = p->task;
+        void *targ                        = p->arg;
+        size_t i                          = p->next++;
+
+        pthread_mutex_unlock(&p->lock);
+        task(targ, i);
+        pthread_mutex_lock(&p->lock);
+
+        if (++p->finished == p->n)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+/* Stops and frees the worker pool of a root reader, if it has one. */
+static void pool_free(SBReader *reader)
+{
+    WorkerPool *p = reader->pool;
+    if (p == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (size_t i = 0; i < p->nthreads; i++)
+        pthread_join(p->threads[i], NULL);
+
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->start);
+    pthread_mutex_destroy(&p->lock);
+    reader->free(p);
+    reader->pool = NULL;
+}
+#endif
+
+/*
+ * Makes sure the worker pool of a root reader has a thread for each but one piece of
+ * its parallel copies, which the copying thread runs itself. Pieces without a thread
+ * are run by the copying thread, if the pool cannot be made or grown.
+ */
+static void pool_start(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    WorkerPool *p = reader->pool;
+
+    if (p == NULL) {
+        p = reader->malloc(sizeof(*p));
+        if (p == NULL)
+            return;
+        if (pthread_mutex_init(&p->lock, NULL) != 0) {
+            reader->free(p);
+            return;
+        } else if (pthread_cond_init(&p->start, NULL) != 0) {
+            pthread_mutex_destroy(&p->lock);
+            reader->free(p);
+            return;
+        } else if (pthread_cond_init(&p->done, NULL) != 0) {
+            pthread_cond_destroy(&p->start);
+            pthread_mutex_destroy(&p->lock);
+            reader->free(p);
+            return;
+        }
+        p->task     = NULL;
+        p->stop     = false;
+        p->nthreads = 0;
+
+        reader->pool = p;
+    }
+
+    /* Threads only read the shared fields, under the lock, so they can be added while others run. */
+    while (p->nthreads + 1 < reader->parallel_workers) {
+        if (pthread_create(&p->threads[p->nthreads], NULL, worker_main, p) != 0)
+            break;
+        p->nthreads++;
+    }
+#else
+    (void) reader;
+#endif
+}
+
+/*
+ * Runs tasks 0 to n - 1 on the threads of a worker pool, and on the calling one. Used
+ * without a user pool. If the pool is already running a copy for another thread, or
+ * there is no pool, all of them are run on the calling thread.
+ */
+static void run_threads(void *pool, void (*task)(void *arg, size_t i), void *arg, size_t n)
+{
+#if defined(SB_POSIX)
+    WorkerPool *p = pool;
+
+    if (p != NULL) {
+        pthread_mutex_lock(&p->lock);
+        if (p->task == NULL) {
+            p->task     = task;
+            p->arg      = arg;
+            p->n        = n;
+            p->next     = 0;
+            p->finished = 0;
+            pthread_cond_broadcast(&p->start);
+
+            /* Take pieces alongside the workers, so that none is left if they are slow to wake. */
+            while (p->next < n) {
+                size_t i = p->next++;
+                pthread_mutex_unlock(&p->lock);
+                task(arg, i);
+                pthread_mutex_lock(&p->lock);
+                p->finished++;
+            }
+            while (p->finished < n)
+                pthread_cond_wait(&p->done, &p->lock);
+
+            p->task = NULL;
+            pthread_mutex_unlock(&p->lock);
+            return;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+#else
+    (void) pool;
+#endif
+
+    for (size_t i = 0; i < n; i++)
+        task(arg, i);
+}
+
+static void copy_data(SBReader *reader, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    SBReader *root = reader->parent != NULL ? reader->parent : reader;
+
+    if (root->parallel_threshold == 0 || n < root->parallel_threshold || root->parallel_workers < 2) {
+        copy_block(reader, dst, src, n);
+        return;
+    }
+
+    /* Split into page multiples, so that each worker's stores stay aligned. */
+    CopyTask t = { reader, dst, src, n, 0 };
+    t.chunk    = (n / root->parallel_workers + 4095) & ~(size_t) 4095;
+
+    root->parallel_run(root->parallel_pool, copy_task, &t, (n + t.chunk - 1) / t.chunk);
+}
+
+/* Zeroes n bytes at dst, bypassing the cache above the reader's streaming threshold. */
+static void zero_fill(SBReader *reader, uint8_t *dst, size_t n)
+{
+#if defined(SB_X86_SIMD)
+    SBReader *root = reader->parent != NULL ? reader->parent : reader;
+
+    if (root->stream_threshold != 0 && n >= root->stream_threshold && __builtin_cpu_supports("sse2")) {
+        zero_stream_sse2(dst, n);
+        return;
+    }
+#else
+    (void) reader;
+#endif
+
+    memset(dst, 0, n);
+}
+
 /*
  * Util functions for ranges.
  */
 
-/* Fees all ranges in the list. */
+static DataHeader *data_header(uint8_t *data)
+{
+    return (DataHeader *) (data - DATA_HEADER_SIZE);
+}
+
+/* Checks if range data points into the reader's mapped file, rather than being allocated. */
+static bool data_mapped(SBReader *reader, const uint8_t *data)
+{
+    FileMap *map = reader->map;
+
+    return map != NULL && (uintptr_t) data >= (uintptr_t) map->base &&
+           (uintptr_t) data < (uintptr_t) map->base + map->size;
+}
+
+/* Allocates range data, used by one range. */
+static uint8_t *data_alloc(SBReader *reader, size_t size)
+{
+    uint8_t *p = reader->malloc(DATA_HEADER_SIZE + size);
+    if (p == NULL)
+        return NULL;
+
+    ((DataHeader *) p)->refs  = 1;
+    ((DataHeader *) p)->spill = NULL;
+
+    return p + DATA_HEADER_SIZE;
+}
+
+#if defined(SB_POSIX)
+/* Takes len bytes of a spill file, from the first hole large enough, or from its end. */
+static uint64_t spill_take(SpillFile *sf, uint64_t len)
+{
+    pthread_mutex_lock(&sf->lock);
+
+    uint64_t off = UINT64_MAX;
+    for (SpillHole **hp = &sf->holes; *hp != NULL; hp = &(*hp)->next) {
+        SpillHole *h = *hp;
+        if (h->len < len)
+            continue;
+
+        off     = h->off;
+        h->off += len;
+        h->len -= len;
+        if (h->len == 0) {
+            *hp = h->next;
+            sf->free(h);
+        }
+        break;
+    }
+    if (off == UINT64_MAX) {
+        off      = sf->end;
+        sf->end += len;
+    }
+
+    pthread_mutex_unlock(&sf->lock);
+
+    return off;
+}
+
+/*
+ * Gives len bytes at off back to a spill file, merging them with the holes next to
+ * them, and shrinking the file if they end it. If no hole can be allocated, the space
+ * is only reused once its neighbours are freed.
+ */
+static void spill_give(SpillFile *sf, uint64_t off, uint64_t len)
+{
+    pthread_mutex_lock(&sf->lock);
+
+    SpillHole **hp = &sf->holes;
+    while (*hp != NULL && (*hp)->off + (*hp)->len < off)
+        hp = &(*hp)->next;
+
+    SpillHole *prev = *hp != NULL && (*hp)->off + (*hp)->len == off ? *hp : NULL;
+    if (prev != NULL) {
+        prev->len += len;
+        hp = &prev->next;
+    }
+    if (*hp != NULL && (*hp)->off == off + len) {
+        SpillHole *next = *hp;
+        if (prev != NULL) {
+            prev->len += next->len;
+            *hp = next->next;
+            sf->free(next);
+        } else {
+            next->off  = off;
+            next->len += len;
+            prev       = next;
+        }
+    } else if (prev == NULL) {
+        SpillHole *h = sf->malloc(sizeof(*h));
+        if (h != NULL) {
+            h->off  = off;
+            h->len  = len;
+            h->next = *hp;
+            *hp     = h;
+            prev    = h;
+        } else if (off + len == sf->end) {
+            sf->end = off;
+            ftruncate(sf->fd, (off_t) sf->end);
+        }
+    }
+
+    /* A hole at the end of the file is given back by shrinking it. */
+    if (prev != NULL && prev->next == NULL && prev->off + prev->len == sf->end) {
+        SpillHole **last = &sf->holes;
+        while (*last != prev)
+            last = &(*last)->next;
+        *last   = NULL;
+        sf->end = prev->off;
+        sf->free(prev);
+        ftruncate(sf->fd, (off_t) sf->end);
+    }
+
+    pthread_mutex_unlock(&sf->lock);
+}
+#endif
+
+/* Drops a reader's, or spilled data's, use of a spill file. */
+static void spill_put(SpillFile *sf)
+{
+#if defined(SB_POSIX)
+    if (ATOMIC_SUB(&sf->refs, 1) != 0)
+        return;
+
+    while (sf->holes != NULL) {
+        SpillHole *next = sf->holes->next;
+        sf->free(sf->holes);
+        sf->holes = next;
+    }
+    pthread_mutex_destroy(&sf->lock);
+    close(sf->fd);
+    sf->free(sf);
+#else
+    (void) sf;
+#endif
+}
+
+/* Frees range data which no range uses any more. */
+static void data_destroy(SBReader *reader, uint8_t *data)
+{
+    if (data_mapped(reader, data))
+        return;
+
+    DataHeader *h = data_header(data);
+#if defined(SB_POSIX)
+    if (h->spill != NULL) {
+        SpillFile *sf   = h->spill;
+        off_t off       = (off_t) h->spill_off;
+        size_t len      = h->spill_len;
+        size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+
+        /* The header's page goes with the mapping of the data. */
+        munmap(data - pagesize, pagesize + len);
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        fallocate(sf->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, (off_t) len);
+#endif
+        /* Only reusable once punched, so that a later spill's data is never punched out. */
+        spill_give(sf, (uint64_t) off, len);
+        spill_put(sf);
+        return;
+    }
+#endif
+
+    reader->free(h);
+}
+
+/* Adds a range using range data. */
+static void data_ref(SBReader *reader, uint8_t *data)
+{
+    if (data_mapped(reader, data))
+        return;
+
+    ATOMIC_ADD(&data_header(data)->refs, 1);
+}
+
+/* Drops a use of range data, freeing it once unused. No lock-free read may still be using it. */
+static void data_unref(SBReader *reader, uint8_t *data)
+{
+    if (data_mapped(reader, data))
+        return;
+
+    if (ATOMIC_SUB(&data_header(data)->refs, 1) == 0)
+        data_destroy(reader, data);
+}
+
+/*
+ * Removes a range using range data, freeing it once unused. With lock-free reads, the
+ * use is only dropped once no read can still be using it, since snapshots or clones
+ * sharing the data may drop theirs, and free it, on other threads meanwhile.
+ */
+static void data_free(SBReader *reader, uint8_t *data)
+{
+    if (data_mapped(reader, data))
+        return;
+
+    if (reader->flags & SB_LOCK_FREE_READS) {
+        assert(reader->nretired < reader->retired_max);
+        reader->retired[reader->nretired++] = data;
+        return;
+    }
+
+    data_unref(reader, data);
+}
+
+/*
+ * Shrinks range data. Lock-free reads may still be using its old size, and other
+ * readers may be sharing it, so then it is left as-is.
+ */
+static uint8_t *data_shrink(SBReader *reader, uint8_t *data, size_t size)
+{
+    if ((reader->flags & SB_LOCK_FREE_READS) || data_mapped(reader, data) ||
+        ATOMIC_LOAD(&data_header(data)->refs) != 1 || data_header(data)->spill != NULL)
+        return data;
+
+    uint8_t *p = reader->realloc(data_header(data), DATA_HEADER_SIZE + size);
+
+    return p != NULL ? p + DATA_HEADER_SIZE : NULL;
+}
+
+/* Fees all ranges in the list. No lock-free read may still be using them. */
 static void range_free(SBReader *reader, Range **ranges)
 {
     Range *cur = *ranges;
@@ -52,7 +835,7 @@ static void range_free(SBReader *reader, Range **ranges)
     while (cur != NULL) {
         Range *tmp = cur;
 
-        reader->free(cur->data);
+        data_unref(reader, cur->data);
 
         cur = cur->next;
 
@@ -62,6 +845,71 @@ static void range_free(SBReader *reader, Range **ranges)
     *ranges = NULL;
 }
 
+/* Drops a reader's ranges, freeing them unless other readers still share them. */
+static void ranges_release(SBReader *reader)
+{
+    if (reader->ranges_refs != NULL) {
+        if (ATOMIC_SUB(reader->ranges_refs, 1) != 0) {
+            reader->ranges      = NULL;
+            reader->ranges_refs = NULL;
+            return;
+        }
+        reader->free(reader->ranges_refs);
+        reader->ranges_refs = NULL;
+    }
+
+    range_free(reader, &reader->ranges);
+}
+
+/*
+ * Gives a reader its own copy of the ranges it shares with snapshots or clones, before
+ * it changes them. The range data is still shared, and never changed in place.
+ */
+static int ranges_unshare(SBReader *reader, SBError *err)
+{
+    if (reader->ranges_refs == NULL)
+        return 0;
+
+    /* The others have all gone away. */
+    if (ATOMIC_LOAD(reader->ranges_refs) == 1) {
+        reader->free(reader->ranges_refs);
+        reader->ranges_refs = NULL;
+        return 0;
+    }
+
+    Range *head = NULL, *tail = NULL;
+    for (Range *e = reader->ranges; e != NULL; e = e->next) {
+        Range *c = reader->malloc(sizeof(*c));
+        if (c == NULL) {
+            range_free(reader, &head);
+            snprintf(err->error, err->size, "Could not allocate range copy.");
+            return -1;
+        }
+
+        c->prev      = tail;
+        c->next      = NULL;
+        c->pos       = e->pos;
+        c->size      = e->size;
+        c->data      = e->data;
+        c->crc       = ATOMIC_LOAD(&e->crc);
+        c->crc_valid = ATOMIC_LOAD(&e->crc_valid);
+        c->used      = ATOMIC_LOAD(&e->used);
+        data_ref(reader, c->data);
+
+        if (tail != NULL)
+            tail->next = c;
+        else
+            head = c;
+        tail = c;
+    }
+
+    /* Others may have gone away while copying, leaving the old ranges to us. */
+    ranges_release(reader);
+    reader->ranges = head;
+
+    return 0;
+}
+
 /* Removes a specific range from the list. */
 static void range_remove(SBReader *reader, Range **r, size_t pos)
 {
@@ -75,25 +923,19 @@ static void range_remove(SBReader *reader, Range **r, size_t pos)
     assert(rm != NULL);
 
     if (rm->prev == NULL && rm->next == NULL) {
-        range_free(reader, r);
+        *r = NULL;
     } else if (rm->next == NULL) {
         rm->prev->next = NULL;
-
-        reader->free(rm->data);
-        reader->free(rm);
     } else if (rm->prev == NULL) {
         rm->next->prev = NULL;
         *r             = rm->next;
-
-        reader->free(rm->data);
-        reader->free(rm);
     } else {
         rm->prev->next = rm->next;
         rm->next->prev = rm->prev;
-
-        reader->free(rm->data);
-        reader->free(rm);
     }
+
+    data_free(reader, rm->data);
+    reader->free(rm);
 }
 
 /* Inserts a new range before a given range in the list. */
@@ -167,14 +1009,16 @@ static int merge(SBReader *reader, Range *a, Range *b, Range *ret, bool *merged)
         return 0;
     }
 
+    /* Mapped data is never freed with its range, so may be kept as-is. */
     if (contains(a, b)) {
         ret->pos  = a->pos;
         ret->size = a->size;
-        ret->data = reader->malloc(a->size);
+        ret->data = data_mapped(reader, a->data) ? a->data : data_alloc(reader, a->size);
         if (ret->data == NULL)
             return -1;
 
-        memcpy(ret->data, a->data, a->size);
+        if (ret->data != a->data)
+            copy_data(reader, ret->data, a->data, a->size);
         *merged = true;
         return 0;
     }
@@ -182,11 +1026,12 @@ static int merge(SBReader *reader, Range *a, Range *b, Range *ret, bool *merged)
     if (contains(b, a)) {
         ret->pos  = b->pos;
         ret->size = b->size;
-        ret->data = reader->malloc(b->size);
+        ret->data = data_mapped(reader, b->data) ? b->data : data_alloc(reader, b->size);
         if (ret->data == NULL)
             return -1;
 
-        memcpy(ret->data, b->data, b->size);
+        if (ret->data != b->data)
+            copy_data(reader, ret->data, b->data, b->size);
         *merged = true;
         return 0;
     }
@@ -201,16 +1046,27 @@ static int merge(SBReader *reader, Range *a, Range *b, Range *ret, bool *merged)
     }
 
     size_t newsize = second->pos + second->size - first->pos;
-    uint8_t *buf   = reader->malloc(newsize);
+
+    /* Mapped ranges which are also contiguous in their mapping need no copy. */
+    if (data_mapped(reader, first->data) && data_mapped(reader, second->data) &&
+        (uintptr_t) first->data - first->pos == (uintptr_t) second->data - second->pos) {
+        ret->pos  = first->pos;
+        ret->size = newsize;
+        ret->data = first->data;
+        *merged   = true;
+        return 0;
+    }
+
+    uint8_t *buf = data_alloc(reader, newsize);
     if (buf == NULL)
         return -1;
 
     if (first == a) {
-        memcpy(buf, first->data, first->size);
-        memcpy(buf + first->size, second->data + first->pos + first->size - second->pos, second->size - (first->pos + first->size - second->pos));
+        copy_data(reader, buf, first->data, first->size);
+        copy_data(reader, buf + first->size, second->data + first->pos + first->size - second->pos, second->size - (first->pos + first->size - second->pos));
     } else {
-        memcpy(buf, first->data, second->pos - first->pos);
-        memcpy(buf + second->pos - first->pos, second->data, second->size);
+        copy_data(reader, buf, first->data, second->pos - first->pos);
+        copy_data(reader, buf + second->pos - first->pos, second->data, second->size);
     }
 
     ret->pos  = first->pos;
@@ -221,376 +1077,4084 @@ static int merge(SBReader *reader, Range *a, Range *b, Range *ret, bool *merged)
     return 0;
 }
 
-SBReader *sb_new_reader_custom_alloc(size_t size, void *(*custom_alloc)(size_t size),
-                                     void *(*custom_realloc)(void *ptr, size_t size), void (*custom_free)(void *ptr), SBError *err)
+/*
+ * Reads size bytes at off into buf, walking the list from e. No range before e may
+ * end after off. Returns the first range ending after off, from which any read at
+ * or after off may start.
+ */
+static Range *read_at(SBReader *reader, Range *e, size_t off, uint8_t *buf, size_t size)
+{
+    Range *first = NULL;
+    size_t pos   = 0;
+
+    for (; e != NULL && pos < size; e = e->next) {
+        if (e->pos + e->size <= off)
+            continue;
+        if (first == NULL)
+            first = e;
+        if (e->pos >= off + size)
+            break;
+
+        if (reader->spill != NULL && ATOMIC_LOAD(&e->used) != reader->spill_clock)
+            ATOMIC_STORE(&e->used, reader->spill_clock);
+
+        /* Output zeroes until we hit the start of a range. */
+        size_t cur = off + pos;
+        if (e->pos > cur) {
+            zero_fill(reader, buf + pos, e->pos - cur);
+            pos += e->pos - cur;
+            cur  = e->pos;
+        }
+
+        size_t copysize = e->size - (cur - e->pos);
+        if (copysize > size - pos)
+            copysize = size - pos;
+        copy_data(reader, buf + pos, e->data + (cur - e->pos), copysize);
+        pos += copysize;
+    }
+
+    /* Output zeros until we hit the end the requested size. */
+    if (pos < size)
+        zero_fill(reader, buf + pos, size - pos);
+
+    return first;
+}
+
+/* Invalidates the read window, e.g. when the ranges it may point into change. */
+static void window_reset(SBReader *reader)
+{
+    reader->win.cur = NULL;
+    reader->win.end = NULL;
+}
+
+/* Points the read window at the range containing the current position, if any, searching from e. */
+static void window_set(SBReader *reader, Range *e)
+{
+    /* Thread-safe readers never keep a window, since it is used without the lock. */
+    if (reader->flags & SB_THREAD_SAFE)
+        return;
+
+    size_t pos = reader->base + reader->win.pos;
+    size_t end = reader->base + reader->size;
+
+    /* Holes in a sparse mapping read as zeroes, so the whole reader is one window. */
+    if (reader->flags & SB_SPARSE_MAP) {
+        FileMap *map    = reader->parent != NULL ? reader->parent->map : reader->map;
+        reader->win.cur = map->base + pos;
+        reader->win.end = map->base + end;
+        return;
+    }
+
+    for (; e != NULL && e->pos <= pos; e = e->next) {
+        if (e->pos + e->size > pos) {
+            size_t stop     = e->pos + e->size < end ? e->pos + e->size : end;
+            reader->win.cur = e->data + (pos - e->pos);
+            reader->win.end = e->data + (stop - e->pos);
+            return;
+        }
+    }
+
+    window_reset(reader);
+}
+
+/* Must be called before the ranges of a reader are changed. */
+static void ranges_changed(SBReader *reader)
+{
+    reader->gen++;
+
+    if (reader->flags & SB_THREAD_SAFE)
+        return;
+
+    window_reset(reader);
+    for (SBReader *v = reader->views; v != NULL; v = v->next_view)
+        window_reset(v);
+}
+
+/* Returns the reader owning the ranges of a reader or view, and the view's offset in it. */
+static SBReader *root_get(SBReader *reader, size_t *base)
+{
+    *base = reader->base;
+
+    return reader->parent != NULL ? reader->parent : reader;
+}
+
+/*
+ * Locking for thread-safe readers. These may be called with views, and lock
+ * their root reader. Other readers are not locked.
+ */
+static void lock_shared(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    if (reader->flags & SB_THREAD_SAFE) {
+        size_t base;
+        pthread_rwlock_rdlock(&root_get(reader, &base)->lock);
+    }
+#else
+    (void) reader;
+#endif
+}
+
+static void lock_exclusive(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    if (reader->flags & SB_THREAD_SAFE) {
+        size_t base;
+        pthread_rwlock_wrlock(&root_get(reader, &base)->lock);
+    }
+#else
+    (void) reader;
+#endif
+}
+
+static void unlock(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    if (reader->flags & SB_THREAD_SAFE) {
+        size_t base;
+        pthread_rwlock_unlock(&root_get(reader, &base)->lock);
+    }
+#else
+    (void) reader;
+#endif
+}
+
+/*
+ * Takes the shared lock for a read or seek that moves the position of a reader or view.
+ * Each view is only used by one thread, but the position of a root reader may be shared
+ * by several, so it is also guarded by its own lock, which is never held while taking
+ * another one.
+ */
+static void lock_position(SBReader *reader)
+{
+    lock_shared(reader);
+#if defined(SB_POSIX)
+    if (reader->parent == NULL && (reader->flags & SB_THREAD_SAFE))
+        pthread_mutex_lock(&reader->pos_lock);
+#endif
+}
+
+static void unlock_position(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    if (reader->parent == NULL && (reader->flags & SB_THREAD_SAFE))
+        pthread_mutex_unlock(&reader->pos_lock);
+#endif
+    unlock(reader);
+}
+
+/*
+ * Lock-free reads. Writers still take the exclusive lock, and after changing the
+ * ranges, publish an immutable copy of them as a new version. Readers count
+ * themselves into one of two epochs, on a stripe picked by thread, so that
+ * readers on different threads do not share cache lines, and read the current
+ * version. Once a version is replaced, the writer waits for the readers counted
+ * in both epochs to leave, before freeing it and any range data retired with it.
+ */
+
+/* Reserves room for the range data a change to the ranges may retire. */
+static int retire_reserve(SBReader *reader, SBError *err)
+{
+    if (!(reader->flags & SB_LOCK_FREE_READS) || reader->parent != NULL)
+        return 0;
+
+    /* Each existing range, and the new one and its merged buffer, may be retired. */
+    size_t max = reader->nretired + 2;
+    for (Range *e = reader->ranges; e != NULL; e = e->next)
+        max += 2;
+
+    if (max <= reader->retired_max)
+        return 0;
+
+    uint8_t **tmp;
+    if (reader->retired == NULL)
+        tmp = reader->malloc(max * sizeof(*tmp));
+    else
+        tmp = reader->realloc(reader->retired, max * sizeof(*tmp));
+    if (tmp == NULL) {
+        snprintf(err->error, err->size, "Could not allocate retired range list.");
+        return -1;
+    }
+    reader->retired     = tmp;
+    reader->retired_max = max;
+
+    return 0;
+}
+
+#if defined(SB_EPOCH)
+/* Waits until no lock-free read that started before this call is still running. */
+static void epoch_sync(SBReader *reader)
+{
+    /*
+     * New readers count themselves into the current epoch, so flip it before
+     * waiting for the old one to empty. Flipping twice also waits out readers
+     * which read the epoch before the previous flip, but had not yet been counted.
+     */
+    for (int i = 0; i < 2; i++) {
+        uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_RELAXED);
+        __atomic_store_n(&reader->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+
+        for (size_t s = 0; s < EPOCH_STRIPES; s++) {
+            while (__atomic_load_n(&reader->stripes[s].active[epoch & 1], __ATOMIC_SEQ_CST) != 0)
+                sched_yield();
+        }
+    }
+}
+
+/* Starts a lock-free read of root, returning the counter to pass to epoch_exit(). */
+static uint64_t *epoch_enter(SBReader *root, const Version **v)
+{
+    /* Thread stacks are far apart, so a local's address tells threads apart cheaply. */
+    int local;
+    uint64_t id        = (uint64_t) ((uintptr_t) &local >> 12) * UINT64_C(0x9E3779B97F4A7C15);
+    EpochStripe *s     = &root->stripes[id >> (64 - EPOCH_STRIPE_BITS)];
+    uint64_t *active   = &s->active[__atomic_load_n(&root->epoch, __ATOMIC_RELAXED) & 1];
+
+    __atomic_fetch_add(active, 1, __ATOMIC_SEQ_CST);
+    *v = __atomic_load_n(&root->version, __ATOMIC_SEQ_CST);
+
+    return active;
+}
+
+static void epoch_exit(uint64_t *active)
+{
+    __atomic_fetch_sub(active, 1, __ATOMIC_RELEASE);
+}
+#endif
+
+/* Publishes the current ranges of a reader with lock-free reads, and frees what was retired. */
+static int publish(SBReader *reader, SBError *err)
+{
+#if defined(SB_EPOCH)
+    if (!(reader->flags & SB_LOCK_FREE_READS) || reader->parent != NULL)
+        return 0;
+
+    size_t count = 0;
+    for (Range *e = reader->ranges; e != NULL; e = e->next)
+        count++;
+
+    Version *v = reader->spare;
+    if (v->max < count) {
+        v = reader->malloc(sizeof(*v) + count * sizeof(v->ext[0]));
+        if (v == NULL) {
+            snprintf(err->error, err->size, "Could not allocate range version.");
+            return -1;
+        }
+        v->max = count;
+        reader->free(reader->spare);
+    }
+
+    v->size  = reader->size;
+    v->count = count;
+    count    = 0;
+    for (Range *e = reader->ranges; e != NULL; e = e->next, count++) {
+        v->ext[count].pos  = e->pos;
+        v->ext[count].size = e->size;
+        v->ext[count].data = e->data;
+    }
+
+    reader->spare = reader->version;
+    __atomic_store_n(&reader->version, v, __ATOMIC_SEQ_CST);
+
+    epoch_sync(reader);
+
+    for (size_t i = 0; i < reader->nretired; i++)
+        data_unref(reader, reader->retired[i]);
+    reader->nretired = 0;
+#else
+    (void) reader;
+    (void) err;
+#endif
+
+    return 0;
+}
+
+/* Reads size bytes at off from a published version into buf. */
+static void version_read(SBReader *root, const Version *v, size_t off, uint8_t *buf, size_t size)
+{
+    /* Find the first extent ending after off. */
+    size_t lo = 0, hi = v->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (v->ext[mid].pos + v->ext[mid].size <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    size_t pos = 0;
+    for (size_t i = lo; i < v->count && pos < size; i++) {
+        const Extent *ext = &v->ext[i];
+        if (ext->pos >= off + size)
+            break;
+
+        size_t cur = off + pos;
+        if (ext->pos > cur) {
+            zero_fill(root, buf + pos, ext->pos - cur);
+            pos += ext->pos - cur;
+            cur  = ext->pos;
+        }
+
+        size_t copysize = ext->size - (cur - ext->pos);
+        if (copysize > size - pos)
+            copysize = size - pos;
+        copy_data(root, buf + pos, ext->data + (cur - ext->pos), copysize);
+        pos += copysize;
+    }
+
+    if (pos < size)
+        zero_fill(root, buf + pos, size - pos);
+}
+
+/* Reads size bytes at *pos in a reader or view without locking, and advances *pos. */
+static size_t read_lock_free(SBReader *reader, size_t *pos, uint8_t *buf, size_t size, SBError *err)
+{
+#if defined(SB_EPOCH)
+    size_t base;
+    SBReader *root = root_get(reader, &base);
+
+    const Version *v;
+    uint64_t *active = epoch_enter(root, &v);
+
+    size_t rsize = reader->parent != NULL ? reader->size : v->size;
+    if (size == 0) {
+        snprintf(err->error, err->size, "Cannot read zero bytes.");
+        size = 0;
+    } else if (*pos > rsize || size > rsize - *pos) {
+        snprintf(err->error, err->size, "Cannot read past EOF.");
+        size = 0;
+    } else {
+        version_read(root, v, base + *pos, buf, size);
+        *pos += size;
+    }
+
+    epoch_exit(active);
+
+    return size;
+#else
+    (void) reader;
+    (void) pos;
+    (void) buf;
+    (void) size;
+    snprintf(err->error, err->size, "Lock-free reads are not supported on this platform.");
+    return 0;
+#endif
+}
+
+/* Returns the first range ending after off, searching from e. No range before e may end after off. */
+static Range *range_find(Range *e, size_t off)
+{
+    while (e != NULL && e->pos + e->size <= off)
+        e = e->next;
+
+    return e;
+}
+
+/*
+ * Returns a saved range hint to search for off from, if the ranges have not changed
+ * since it was saved, and no range before it ends after off. Otherwise, returns the
+ * first range.
+ */
+static Range *hint_get(SBReader *reader, void *hint, uint64_t gen, size_t off)
+{
+    Range *h = hint;
+
+    if (h != NULL && gen == reader->gen && (h->prev == NULL || h->prev->pos + h->prev->size <= off))
+        return h;
+
+    return reader->ranges;
+}
+
+/*
+ * Gets the loaded or unloaded extent starting at off, and ending no later than end,
+ * searching from e. No range before e may end after off. Returns the range to search
+ * from for the next extent.
+ */
+static Range *extent_get(Range *e, size_t off, size_t end, Extent *ext)
+{
+    e = range_find(e, off);
+
+    ext->pos = off;
+    if (e != NULL && e->pos <= off) {
+        ext->size = e->pos + e->size - off;
+        ext->data = e->data + (off - e->pos);
+    } else {
+        ext->size = (e != NULL ? e->pos : end) - off;
+        ext->data = NULL;
+    }
+    if (ext->size > end - off)
+        ext->size = end - off;
+
+    return e;
+}
+
+/* Returns whether [start, end) of a reader is entirely loaded. */
+static bool span_loaded(SBReader *reader, size_t start, size_t end)
+{
+    Range *e = range_find(reader->ranges, start);
+    if (e == NULL || e->pos > start)
+        return false;
+
+    for (; e->pos + e->size < end; e = e->next) {
+        if (e->next == NULL || e->next->pos != e->pos + e->size)
+            return false;
+    }
+
+    return true;
+}
+
+/* Frees a list of notifications. */
+static void notify_free(SBReader *reader, Notify *n)
+{
+    while (n != NULL) {
+        Notify *next = n->next;
+        reader->free(n);
+        n = next;
+    }
+}
+
+/* Takes the lock protecting waiters and notifications of a root reader, if it is thread-safe. */
+static void notify_lock(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    if (reader->flags & SB_THREAD_SAFE)
+        pthread_mutex_lock(&reader->wait_lock);
+#else
+    (void) reader;
+#endif
+}
+
+static void notify_unlock(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    if (reader->flags & SB_THREAD_SAFE)
+        pthread_mutex_unlock(&reader->wait_lock);
+#else
+    (void) reader;
+#endif
+}
+
+/* Wakes the threads waiting on a root reader to check their spans again, after its position moved. */
+static void waiters_wake(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    if (reader->parent != NULL || ATOMIC_LOAD(&reader->waiters) == NULL)
+        return;
+
+    pthread_mutex_lock(&reader->wait_lock);
+    for (Waiter *w = reader->waiters; w != NULL; w = w->next)
+        pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&reader->wait_lock);
+#else
+    (void) reader;
+#endif
+}
+
+/* Unlinks a notification from the pending list. */
+static void notify_unlink(SBReader *reader, Notify *n)
+{
+    if (n->prev != NULL)
+        n->prev->next = n->next;
+    else
+        ATOMIC_STORE(&reader->notifies, n->next);
+    if (n->next != NULL)
+        n->next->prev = n->prev;
+}
+
+/* Makes the event fd readable, or empties it. */
+static void event_fd_signal(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    /* Failing to write to a full pipe is fine, since it is readable already. */
+    uint64_t one = 1;
+    if (reader->event_wfd >= 0 && write(reader->event_wfd, &one, sizeof(one)) < 0)
+        return;
+#else
+    (void) reader;
+#endif
+}
+
+static void event_fd_drain(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    uint64_t buf[8];
+    if (reader->event_fd >= 0) {
+        while (read(reader->event_fd, &buf[0], sizeof(buf)) > 0)
+            ;
+    }
+#else
+    (void) reader;
+#endif
+}
+
+#if defined(SB_POSIX)
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+
+/*
+ * Sparse mapped readers keep all range data at its own offset in one anonymous
+ * mapping of the whole reader, which is its map, and keep every byte outside of
+ * the ranges zero. Pages are only backed by memory once written to.
+ */
+static int sparse_init(SBReader *reader, size_t size, SBError *err)
+{
+    FileMap *map = reader->malloc(sizeof(*map));
+    if (map == NULL) {
+        snprintf(err->error, err->size, "Could not allocate sparse mapping.");
+        return -1;
+    }
+    map->refs = 1;
+    map->size = size;
+    map->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map->base == MAP_FAILED) {
+        reader->free(map);
+        snprintf(err->error, err->size, "Could not map sparse buffer: %s.", strerror(errno));
+        return -1;
+    }
+    reader->map = map;
+
+    return 0;
+}
+
+/* Zeroes [start, end) of a sparse mapping, giving whole pages back to the kernel. */
+static void sparse_release(SBReader *reader, size_t start, size_t end)
+{
+    uint8_t *p       = reader->map->base + start;
+    uint8_t *q       = reader->map->base + end;
+    uintptr_t mask   = (uintptr_t) sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t pstart = ((uintptr_t) p + mask) & ~mask;
+    uintptr_t pend   = (uintptr_t) q & ~mask;
+
+    if (pstart < pend && madvise((void *) pstart, pend - pstart, MADV_DONTNEED) == 0) {
+        zero_fill(reader, p, (uint8_t *) pstart - p);
+        zero_fill(reader, (uint8_t *) pend, q - (uint8_t *) pend);
+        return;
+    }
+
+    zero_fill(reader, p, end - start);
+}
+
+/* Grows a sparse mapping to size bytes, moving the range data with it. */
+static int sparse_grow(SBReader *reader, size_t size, SBError *err)
+{
+    FileMap *map = reader->map;
+    if (size <= map->size)
+        return 0;
+
+#if defined(__linux__)
+    uint8_t *base = mremap(map->base, map->size, size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        snprintf(err->error, err->size, "Could not grow sparse mapping: %s.", strerror(errno));
+        return -1;
+    }
+#else
+    uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        snprintf(err->error, err->size, "Could not grow sparse mapping: %s.", strerror(errno));
+        return -1;
+    }
+    for (Range *e = reader->ranges; e != NULL; e = e->next)
+        copy_data(reader, base + e->pos, e->data, e->size);
+    munmap(map->base, map->size);
+#endif
+
+    ranges_changed(reader);
+    map->base = base;
+    map->size = size;
+    for (Range *e = reader->ranges; e != NULL; e = e->next)
+        e->data = base + e->pos;
+
+    return 0;
+}
+#endif
+
+/*
+ * Writes a range loaded into a sparse mapped reader in place, returning where. As with
+ * ranges which are merged, the data of a range the new one is inside of is kept.
+ */
+static uint8_t *sparse_write(SBReader *reader, size_t pos, const uint8_t *buf, size_t size)
+{
+    uint8_t *dst = reader->map->base + pos;
+
+    for (Range *e = reader->ranges; e != NULL && e->pos <= pos; e = e->next) {
+        if (e->pos + e->size >= pos + size && (e->pos != pos || e->size != size))
+            return dst;
+    }
+
+    copy_data(reader, dst, buf, size);
+
+    return dst;
+}
+
+SBReader *sb_new_reader_flags(size_t size, int flags, void *(*custom_alloc)(size_t size),
+                              void *(*custom_realloc)(void *ptr, size_t size), void (*custom_free)(void *ptr), SBError *err)
+{
+    SBReader *ret;
+
+    if (size == 0) {
+        snprintf(err->error, err->size, "Invalid reader size.");
+        return NULL;
+    } else if (flags & ~(SB_THREAD_SAFE | SB_LOCK_FREE_READS | SB_SPARSE_MAP)) {
+        snprintf(err->error, err->size, "Invalid reader flags.");
+        return NULL;
+    } else if ((flags & SB_SPARSE_MAP) && (flags & SB_LOCK_FREE_READS)) {
+        snprintf(err->error, err->size, "Sparse mapped readers cannot have lock-free reads.");
+        return NULL;
+    }
+#if !defined(SB_POSIX)
+    if (flags & SB_THREAD_SAFE) {
+        snprintf(err->error, err->size, "Thread-safe readers are not supported on this platform.");
+        return NULL;
+    } else if (flags & SB_SPARSE_MAP) {
+        snprintf(err->error, err->size, "Sparse mapped readers are not supported on this platform.");
+        return NULL;
+    }
+#endif
+#if !defined(SB_EPOCH)
+    if (flags & SB_LOCK_FREE_READS) {
+        snprintf(err->error, err->size, "Lock-free reads are not supported on this platform.");
+        return NULL;
+    }
+#endif
+
+    if (flags & SB_LOCK_FREE_READS)
+        flags |= SB_THREAD_SAFE;
+
+    if (custom_alloc == NULL) {
+        custom_alloc   = malloc;
+        custom_realloc = realloc;
+        custom_free    = free;
+    }
+
+    ret = custom_alloc(sizeof(*ret));
+    if (ret == NULL) {
+        snprintf(err->error, err->size, "Could not allocate SBReader.");
+        return NULL;
+    }
+
+    ret->win.pos = 0;
+    ret->win.cur = NULL;
+    ret->win.end = NULL;
+    ret->size    = size;
+    ret->ranges  = NULL;
+    ret->gen     = 0;
+
+    ret->ranges_refs = NULL;
+    ret->read_only   = false;
+    ret->map         = NULL;
+
+    ret->spill       = NULL;
+    ret->spill_limit = 0;
+    ret->spill_clock = 0;
+
+    ret->malloc  = custom_alloc;
+    ret->realloc = custom_realloc;
+    ret->free    = custom_free;
+
+    ret->stream_threshold = DEFAULT_STREAM_THRESHOLD;
+    ret->flags            = flags;
+
+    ret->parallel_threshold = 0;
+    ret->parallel_workers   = 1;
+    ret->parallel_run       = run_threads;
+    ret->parallel_pool      = NULL;
+    ret->pool               = NULL;
+
+    ret->parent    = NULL;
+    ret->base      = 0;
+    ret->views     = NULL;
+    ret->prev_view = NULL;
+    ret->next_view = NULL;
+
+    ret->version     = NULL;
+    ret->spare       = NULL;
+    ret->epoch       = 0;
+    ret->stripes     = NULL;
+    ret->retired     = NULL;
+    ret->nretired    = 0;
+    ret->retired_max = 0;
+
+    ret->notifies   = NULL;
+    ret->ready      = NULL;
+    ret->ready_tail = NULL;
+    ret->event_fd   = -1;
+    ret->event_wfd  = -1;
+
+    if (flags & SB_LOCK_FREE_READS) {
+        ret->version = custom_alloc(sizeof(Version));
+        ret->spare   = custom_alloc(sizeof(Version));
+        ret->stripes = custom_alloc(EPOCH_STRIPES * sizeof(EpochStripe));
+        if (ret->version == NULL || ret->spare == NULL || ret->stripes == NULL) {
+            if (ret->version != NULL)
+                custom_free(ret->version);
+            if (ret->spare != NULL)
+                custom_free(ret->spare);
+            if (ret->stripes != NULL)
+                custom_free(ret->stripes);
+            custom_free(ret);
+            snprintf(err->error, err->size, "Could not allocate lock-free read state.");
+            return NULL;
+        }
+        ret->version->size  = size;
+        ret->version->count = 0;
+        ret->version->max   = 0;
+        ret->spare->max     = 0;
+        memset(ret->stripes, 0, EPOCH_STRIPES * sizeof(EpochStripe));
+    }
+
+#if defined(SB_POSIX)
+    ret->waiters = NULL;
+    if ((flags & SB_THREAD_SAFE) && pthread_rwlock_init(&ret->lock, NULL) != 0) {
+        if (flags & SB_LOCK_FREE_READS) {
+            custom_free(ret->version);
+            custom_free(ret->spare);
+            custom_free(ret->stripes);
+        }
+        custom_free(ret);
+        snprintf(err->error, err->size, "Could not initialize reader lock.");
+        return NULL;
+    }
+    if ((flags & SB_THREAD_SAFE) && pthread_mutex_init(&ret->wait_lock, NULL) != 0) {
+        pthread_rwlock_destroy(&ret->lock);
+        if (flags & SB_LOCK_FREE_READS) {
+            custom_free(ret->version);
+            custom_free(ret->spare);
+            custom_free(ret->stripes);
+        }
+        custom_free(ret);
+        snprintf(err->error, err->size, "Could not initialize reader lock.");
+        return NULL;
+    }
+    if ((flags & SB_THREAD_SAFE) && pthread_mutex_init(&ret->pos_lock, NULL) != 0) {
+        pthread_mutex_destroy(&ret->wait_lock);
+        pthread_rwlock_destroy(&ret->lock);
+        if (flags & SB_LOCK_FREE_READS) {
+            custom_free(ret->version);
+            custom_free(ret->spare);
+            custom_free(ret->stripes);
+        }
+        custom_free(ret);
+        snprintf(err->error, err->size, "Could not initialize reader lock.");
+        return NULL;
+    }
+
+    if ((flags & SB_SPARSE_MAP) && sparse_init(ret, size, err) < 0) {
+        sb_free_reader(&ret);
+        return NULL;
+    }
+#endif
+
+    return ret;
+}
+
+SBReader *sb_new_reader_custom_alloc(size_t size, void *(*custom_alloc)(size_t size),
+                                     void *(*custom_realloc)(void *ptr, size_t size), void (*custom_free)(void *ptr), SBError *err)
+{
+    return sb_new_reader_flags(size, 0, custom_alloc, custom_realloc, custom_free, err);
+}
+
+SBReader *sb_new_reader(size_t size, SBError *err)
+{
+    return sb_new_reader_flags(size, 0, malloc, realloc, free, err);
+}
+
+SBReader *sb_new_view(SBReader *parent, size_t offset, size_t length, SBError *err)
+{
+    SBReader *ret;
+
+    lock_shared(parent);
+    size_t size = parent->size;
+    unlock(parent);
+
+    if (length == 0 || offset > size || length > size - offset) {
+        snprintf(err->error, err->size, "Invalid view range.");
+        return NULL;
+    }
+
+    size_t base;
+    SBReader *root = root_get(parent, &base);
+
+    ret = root->malloc(sizeof(*ret));
+    if (ret == NULL) {
+        snprintf(err->error, err->size, "Could not allocate SBReader.");
+        return NULL;
+    }
+
+    ret->win.pos = 0;
+    ret->win.cur = NULL;
+    ret->win.end = NULL;
+    ret->size    = length;
+    ret->ranges  = NULL;
+    ret->gen     = 0;
+
+    ret->ranges_refs = NULL;
+    ret->read_only   = false;
+    ret->map         = NULL;
+
+    ret->spill       = NULL;
+    ret->spill_limit = 0;
+    ret->spill_clock = 0;
+
+    ret->malloc  = root->malloc;
+    ret->realloc = root->realloc;
+    ret->free    = root->free;
+
+    ret->flags = root->flags;
+
+    ret->stream_threshold   = 0;
+    ret->parallel_threshold = 0;
+    ret->parallel_workers   = 1;
+    ret->parallel_run       = run_threads;
+    ret->parallel_pool      = NULL;
+    ret->pool               = NULL;
+
+    ret->parent    = root;
+    ret->base      = base + offset;
+    ret->views     = NULL;
+    ret->prev_view = NULL;
+
+    ret->version     = NULL;
+    ret->spare       = NULL;
+    ret->epoch       = 0;
+    ret->stripes     = NULL;
+    ret->retired     = NULL;
+    ret->nretired    = 0;
+    ret->retired_max = 0;
+
+    ret->notifies   = NULL;
+    ret->ready      = NULL;
+    ret->ready_tail = NULL;
+    ret->event_fd   = -1;
+    ret->event_wfd  = -1;
+
+    lock_exclusive(root);
+    ret->next_view = root->views;
+    if (root->views != NULL)
+        root->views->prev_view = ret;
+    root->views = ret;
+    unlock(root);
+
+    return ret;
+}
+
+/* Makes a new reader sharing the current ranges of a reader, in O(1). */
+static SBReader *reader_share(SBReader *reader, int flags, bool read_only, SBError *err)
+{
+    if (reader->parent != NULL) {
+        snprintf(err->error, err->size, "Cannot share the ranges of a view.");
+        return NULL;
+    } else if (reader->flags & SB_SPARSE_MAP) {
+        snprintf(err->error, err->size, "Cannot share the ranges of a sparse mapped reader.");
+        return NULL;
+    }
+
+    lock_shared(reader);
+    size_t size = reader->size;
+    unlock(reader);
+
+    SBReader *ret = sb_new_reader_flags(size, flags, reader->malloc, reader->realloc, reader->free, err);
+    if (ret == NULL)
+        return NULL;
+
+    lock_exclusive(reader);
+
+    if (reader->ranges != NULL && reader->ranges_refs == NULL) {
+        reader->ranges_refs = reader->malloc(sizeof(*reader->ranges_refs));
+        if (reader->ranges_refs == NULL) {
+            unlock(reader);
+            sb_free_reader(&ret);
+            snprintf(err->error, err->size, "Could not allocate shared range count.");
+            return NULL;
+        }
+        *reader->ranges_refs = 1;
+    }
+    if (reader->ranges_refs != NULL)
+        ATOMIC_ADD(reader->ranges_refs, 1);
+
+    ret->size        = reader->size;
+    ret->ranges      = reader->ranges;
+    ret->ranges_refs = reader->ranges_refs;
+    ret->read_only   = read_only;
+    ret->map         = reader->map;
+    if (ret->map != NULL)
+        ATOMIC_ADD(&ret->map->refs, 1);
+
+    ret->stream_threshold   = reader->stream_threshold;
+    ret->parallel_threshold = reader->parallel_threshold;
+    ret->parallel_workers   = reader->parallel_workers;
+    if (reader->parallel_run != run_threads) {
+        ret->parallel_run  = reader->parallel_run;
+        ret->parallel_pool = reader->parallel_pool;
+    }
+
+    unlock(reader);
+
+    /* The worker pool belongs to the reader it was started for, so give the new one its own. */
+    if (ret->parallel_run == run_threads && ret->parallel_threshold != 0 && ret->parallel_workers > 1) {
+        pool_start(ret);
+        ret->parallel_pool = ret->pool;
+    }
+
+    return ret;
+}
+
+SBReader *sb_snapshot(SBReader *reader, SBError *err)
+{
+    return reader_share(reader, reader->flags & SB_THREAD_SAFE, true, err);
+}
+
+SBReader *sb_clone_reader(SBReader *reader, SBError *err)
+{
+    SBReader *ret = reader_share(reader, reader->flags, false, err);
+    if (ret == NULL)
+        return NULL;
+
+    if (publish(ret, err) < 0) {
+        sb_free_reader(&ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+void sb_free_reader(SBReader **reader)
+{
+    SBReader *r = *reader;
+
+    if (r->parent != NULL) {
+        lock_exclusive(r->parent);
+        if (r->prev_view != NULL)
+            r->prev_view->next_view = r->next_view;
+        else
+            r->parent->views = r->next_view;
+        if (r->next_view != NULL)
+            r->next_view->prev_view = r->prev_view;
+        unlock(r->parent);
+    }
+
+    ranges_release(r);
+
+    if (r->parent == NULL && (r->flags & SB_LOCK_FREE_READS)) {
+        for (size_t i = 0; i < r->nretired; i++)
+            data_unref(r, r->retired[i]);
+        if (r->retired != NULL)
+            r->free(r->retired);
+        r->free(r->version);
+        r->free(r->spare);
+        r->free(r->stripes);
+    }
+
+    if (r->spill != NULL)
+        spill_put(r->spill);
+
+#if defined(SB_POSIX)
+    pool_free(r);
+
+    if (r->map != NULL && ATOMIC_SUB(&r->map->refs, 1) == 0) {
+        munmap(r->map->base, r->map->size);
+        r->free(r->map);
+    }
+#endif
+
+#if defined(SB_POSIX)
+    if (r->parent == NULL && (r->flags & SB_THREAD_SAFE)) {
+        pthread_rwlock_destroy(&r->lock);
+        pthread_mutex_destroy(&r->wait_lock);
+        pthread_mutex_destroy(&r->pos_lock);
+    }
+    if (r->event_fd >= 0)
+        close(r->event_fd);
+    if (r->event_wfd >= 0 && r->event_wfd != r->event_fd)
+        close(r->event_wfd);
+#endif
+
+    notify_free(r, r->notifies);
+    notify_free(r, r->ready);
+
+    void (*custom_free)(void *ptr) = (*reader)->free;
+
+    custom_free(*reader);
+    *reader = NULL;
+}
+
+void sb_clear(SBReader *reader)
+{
+    if (reader->parent != NULL)
+        return;
+
+    lock_exclusive(reader);
+    if (reader->read_only) {
+        unlock(reader);
+        return;
+    }
+    ranges_changed(reader);
+
+    /* Publishing no ranges never needs to allocate, so cannot fail. */
+    Range *ranges  = reader->ranges;
+    reader->ranges = NULL;
+    char e[1];
+    SBError err = { &e[0], 1 };
+    publish(reader, &err);
+
+    reader->ranges = ranges;
+#if defined(SB_POSIX)
+    if (reader->flags & SB_SPARSE_MAP) {
+        for (Range *e = reader->ranges; e != NULL; e = e->next)
+            sparse_release(reader, e->pos, e->pos + e->size);
+    }
+#endif
+    ranges_release(reader);
+    unlock(reader);
+}
+
+size_t sb_bytes_left(SBReader *reader)
+{
+    lock_position(reader);
+    size_t ret = reader->size - reader->win.pos;
+    unlock_position(reader);
+
+    return ret;
+}
+
+SBWindow *sb_window(SBReader *reader)
+{
+    return &reader->win;
+}
+
+size_t sb_size(SBReader *reader)
+{
+    lock_shared(reader);
+    size_t ret = reader->size;
+    unlock(reader);
+
+    return ret;
+}
+
+/* Checks that a range may be loaded, and prepares the ranges to be changed. */
+static int load_check(SBReader *reader, size_t pos, size_t bufsize, SBError *err)
+{
+    if (reader->parent != NULL) {
+        snprintf(err->error, err->size, "Cannot modify a view.");
+        return -1;
+    } else if (reader->read_only) {
+        snprintf(err->error, err->size, "Cannot modify a snapshot.");
+        return -1;
+    } else if (bufsize == 0) {
+        snprintf(err->error, err->size, "Invalid buffer size.");
+        return -1;
+    } else if (pos > reader->size || bufsize > reader->size - pos) {
+        snprintf(err->error, err->size, "Cannot load a range passed the end of the sparse buffer size.");
+        return -1;
+    }
+
+    ranges_changed(reader);
+
+    return ranges_unshare(reader, err);
+}
+
+/* Adds size bytes of range data at pos to the ranges, taking ownership of it. */
+static int range_add(SBReader *reader, size_t pos, uint8_t *data, size_t size, SBError *err)
+{
+    if ((reader->flags & SB_SPARSE_MAP) && !data_mapped(reader, data)) {
+        uint8_t *dst = sparse_write(reader, pos, data, size);
+        data_free(reader, data);
+        data = dst;
+    }
+
+    Range *r = reader->malloc(sizeof(*r));
+    if (r == NULL) {
+        data_free(reader, data);
+        snprintf(err->error, err->size, "Could not allocate new range.");
+        return -1;
+    }
+    r->prev = NULL;
+    r->next = NULL;
+    r->pos  = pos;
+    r->size = size;
+    r->crc_valid = false;
+    r->data      = data;
+    r->used      = reader->spill_clock;
+
+    /* If list is empty, just add the new range and return. */
+    if (reader->ranges == NULL) {
+        reader->ranges = r;
+        return 0;
+    }
+
+    /* Merge with an existing range if needed. */
+    bool merged   = false;
+    Range mr      = { 0 };
+    Range *mrange = NULL;
+    for (Range *e = reader->ranges; e != NULL; e = e->next) {
+        int mret = merge(reader, r, e, &mr, &merged);
+        if (mret < 0) {
+            data_free(reader, r->data);
+            reader->free(r);
+            snprintf(err->error, err->size, "Could not allocate merged buffer.");
+            return -1;
+        }
+        if (merged) {
+            e->pos  = mr.pos;
+            e->size = mr.size;
+            data_free(reader, e->data);
+            e->data      = mr.data;
+            e->crc_valid = false;
+            e->used      = reader->spill_clock;
+            mrange       = e;
+            break;
+        }
+    }
+
+    if (merged) {
+        /* Merge with any further ranges, if necessary. */
+        bool mergeagain = true;
+        while (mergeagain) {
+            mergeagain = false;
+            Range *mrng = mrange;
+            for (Range *e = mrange->next; e != NULL; e = e->next) {
+                bool m;
+                int mret = merge(reader, mrng, e, &mr, &m);
+                if (mret < 0) {
+                    data_free(reader, r->data);
+                    reader->free(r);
+                    snprintf(err->error, err->size, "Could not allocate merged buffer.");
+                    return -1;
+                }
+                if (m) {
+                    mrange->pos  = mr.pos;
+                    mrange->size = mr.size;
+
+                    data_free(reader, mrange->data);
+                    mrange->data      = mr.data;
+                    mrange->crc_valid = false;
+
+                    range_remove(reader, &reader->ranges, e->pos);
+
+                    mergeagain = true;
+                    break;
+                } else {
+                    break;
+                }
+            }
+        }
+        data_free(reader, r->data);
+        reader->free(r);
+    } else {
+        /* Just insert it as-is. */
+        Range *e;
+        for (e = reader->ranges; e != NULL; e = e->next) {
+            if (r->pos < e->pos)
+                break;
+        }
+        if (e == NULL)
+            range_insert_end(reader->ranges, r);
+        else
+            range_insert_before(&reader->ranges, r, e->pos);
+    }
+
+    return 0;
+}
+
+static int load_range(SBReader *reader, size_t pos, uint8_t *buf, size_t bufsize, SBError *err)
+{
+    if (load_check(reader, pos, bufsize, err) < 0)
+        return -1;
+
+    if (reader->flags & SB_SPARSE_MAP)
+        return range_add(reader, pos, sparse_write(reader, pos, buf, bufsize), bufsize, err);
+
+    uint8_t *data = data_alloc(reader, bufsize);
+    if (data == NULL) {
+        snprintf(err->error, err->size, "Could not allocate buffer for spares list entry.");
+        return -1;
+    }
+    copy_data(reader, data, buf, bufsize);
+
+    return range_add(reader, pos, data, bufsize, err);
+}
+
+static size_t read_cur(SBReader *reader, uint8_t *buf, size_t size, SBError *err)
+{
+    if (size == 0) {
+        snprintf(err->error, err->size, "Cannot read zero bytes.");
+        return 0;
+    } else if (size > reader->size - reader->win.pos) {
+        snprintf(err->error, err->size, "Cannot read past EOF.");
+        return 0;
+    }
+
+    /* Reads within the range at the current position need no list walk. */
+    if (size <= (size_t) (reader->win.end - reader->win.cur)) {
+        copy_data(reader, buf, reader->win.cur, size);
+        reader->win.cur += size;
+        reader->win.pos += size;
+        return size;
+    }
+
+    size_t base;
+    SBReader *root = root_get(reader, &base);
+
+    if (root->flags & SB_SPARSE_MAP) {
+        copy_data(root, buf, root->map->base + base + reader->win.pos, size);
+        reader->win.pos += size;
+        window_set(reader, NULL);
+        return size;
+    }
+
+    Range *e = read_at(root, root->ranges, base + reader->win.pos, buf, size);
+
+    reader->win.pos += size;
+
+    window_set(reader, e);
+
+    return size;
+}
+
+size_t sb_read(SBReader *reader, uint8_t *buf, size_t size, SBError *err)
+{
+    if ((reader->flags & SB_LOCK_FREE_READS) && reader->parent != NULL)
+        return read_lock_free(reader, &reader->win.pos, buf, size, err);
+
+    lock_position(reader);
+    size_t ret = read_cur(reader, buf, size, err);
+    unlock_position(reader);
+
+    waiters_wake(reader);
+
+    return ret;
+}
+
+size_t sb_read_wait(SBReader *reader, uint8_t *buf, size_t size, int timeout_ms, SBError *err)
+{
+#if defined(SB_POSIX)
+    if (!(reader->flags & SB_THREAD_SAFE)) {
+        snprintf(err->error, err->size, "Cannot wait on a reader which is not thread-safe.");
+        return 0;
+    }
+
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    size_t base;
+    SBReader *root = root_get(reader, &base);
+
+    Waiter w;
+    w.prev  = NULL;
+    w.start = 0;
+    w.end   = 0;
+    if (pthread_cond_init(&w.cond, NULL) != 0) {
+        snprintf(err->error, err->size, "Could not initialize wait condition.");
+        return 0;
+    }
+
+    size_t ret     = 0;
+    bool timed_out = false;
+    for (;;) {
+        /* Wait in the list before checking, so a load after the check always sees us. */
+        pthread_mutex_lock(&root->wait_lock);
+        w.next = root->waiters;
+        if (w.next != NULL)
+            w.next->prev = &w;
+        ATOMIC_STORE(&root->waiters, &w);
+
+        /* The position of a root reader may be moved by other threads, so check it each time. */
+        bool ready;
+        for (;;) {
+            lock_position(reader);
+            w.start = base + reader->win.pos;
+            w.end   = w.start + size;
+            ready   = size == 0 || size > reader->size - reader->win.pos || w.end > root->size ||
+                      span_loaded(root, w.start, w.end);
+            unlock_position(reader);
+            if (ready || timed_out)
+                break;
+
+            if (timeout_ms < 0)
+                pthread_cond_wait(&w.cond, &root->wait_lock);
+            else if (timeout_ms == 0 || pthread_cond_timedwait(&w.cond, &root->wait_lock, &deadline) == ETIMEDOUT)
+                timed_out = true;
+        }
+
+        if (w.prev != NULL)
+            w.prev->next = w.next;
+        else
+            ATOMIC_STORE(&root->waiters, w.next);
+        if (w.next != NULL)
+            w.next->prev = w.prev;
+        w.prev = NULL;
+        pthread_mutex_unlock(&root->wait_lock);
+
+        if (!ready) {
+            snprintf(err->error, err->size, "Timed out waiting for data.");
+            break;
+        }
+
+        /*
+         * Copy without holding wait_lock, so loads are not held up. The position or the
+         * ranges may have changed in between, in which case wait again.
+         */
+        lock_position(reader);
+        size_t start = base + reader->win.pos;
+        if (size != 0 && size <= reader->size - reader->win.pos && start + size > root->size) {
+            /* The root was shrunk from under a view. */
+            snprintf(err->error, err->size, "Cannot read past EOF.");
+            unlock_position(reader);
+            break;
+        } else if (size == 0 || size > reader->size - reader->win.pos || span_loaded(root, start, start + size)) {
+            ret = read_cur(reader, buf, size, err);
+            unlock_position(reader);
+            break;
+        }
+        unlock_position(reader);
+    }
+
+    pthread_cond_destroy(&w.cond);
+
+    return ret;
+#else
+    (void) reader;
+    (void) buf;
+    (void) size;
+    (void) timeout_ms;
+    snprintf(err->error, err->size, "Waiting is not supported on this platform.");
+    return 0;
+#endif
+}
+
+/* Orders batched read requests by their position. */
+static int req_cmp(const void *a, const void *b)
+{
+    const SBReadReq *ra = *(const SBReadReq * const *) a;
+    const SBReadReq *rb = *(const SBReadReq * const *) b;
+
+    return (ra->pos > rb->pos) - (ra->pos < rb->pos);
+}
+
+static int read_batch(SBReader *reader, const SBReadReq *reqs, size_t n, SBError *err)
+{
+    bool sorted = true;
+    for (size_t i = 0; i < n; i++) {
+        if (reqs[i].size == 0 || reqs[i].pos > reader->size || reqs[i].size > reader->size - reqs[i].pos) {
+            snprintf(err->error, err->size, "Invalid read request %zu.", i);
+            return -1;
+        }
+        if (i > 0 && reqs[i].pos < reqs[i - 1].pos)
+            sorted = false;
+    }
+
+    size_t base;
+    SBReader *root = root_get(reader, &base);
+
+    /* Requests already in order can be satisfied as-is. */
+    if (sorted) {
+        Range *e = root->ranges;
+        for (size_t i = 0; i < n; i++)
+            e = read_at(root, e, base + reqs[i].pos, reqs[i].buf, reqs[i].size);
+        return 0;
+    }
+
+    const SBReadReq **order = reader->malloc(n * sizeof(*order));
+    if (order == NULL) {
+        snprintf(err->error, err->size, "Could not allocate request order.");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++)
+        order[i] = &reqs[i];
+
+    qsort(order, n, sizeof(*order), req_cmp);
+
+    Range *e = root->ranges;
+    for (size_t i = 0; i < n; i++)
+        e = read_at(root, e, base + order[i]->pos, order[i]->buf, order[i]->size);
+
+    reader->free(order);
+
+    return 0;
+}
+
+/* Reads a batch without locking. Each request is found by binary search, so needs no sorting. */
+static int read_batch_lock_free(SBReader *reader, const SBReadReq *reqs, size_t n, SBError *err)
+{
+#if defined(SB_EPOCH)
+    size_t base;
+    SBReader *root = root_get(reader, &base);
+
+    const Version *v;
+    uint64_t *active = epoch_enter(root, &v);
+
+    size_t size = reader->parent != NULL ? reader->size : v->size;
+    int ret     = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (reqs[i].size == 0 || reqs[i].pos > size || reqs[i].size > size - reqs[i].pos) {
+            snprintf(err->error, err->size, "Invalid read request %zu.", i);
+            ret = -1;
+            break;
+        }
+    }
+    for (size_t i = 0; ret == 0 && i < n; i++)
+        version_read(root, v, base + reqs[i].pos, reqs[i].buf, reqs[i].size);
+
+    epoch_exit(active);
+
+    return ret;
+#else
+    (void) reader;
+    (void) reqs;
+    (void) n;
+    snprintf(err->error, err->size, "Lock-free reads are not supported on this platform.");
+    return -1;
+#endif
+}
+
+int sb_read_batch(SBReader *reader, const SBReadReq *reqs, size_t n, SBError *err)
+{
+    if (reader->flags & SB_LOCK_FREE_READS)
+        return read_batch_lock_free(reader, reqs, n, err);
+
+    lock_shared(reader);
+    int ret = read_batch(reader, reqs, n, err);
+    unlock(reader);
+
+    return ret;
+}
+
+static int seek_cur(SBReader *reader, size_t offset, SBWhence whence, size_t *pos, SBError *err)
+{
+    size_t realoffset;
+
+    switch (whence) {
+    case SB_SET:
+        realoffset = offset;
+        break;
+    case SB_CUR:
+        realoffset = offset + reader->win.pos;
+        break;
+    case SB_END:
+        if (offset > reader->size) {
+            snprintf(err->error, err->size, "Cannot seek past beginning of file.");
+            return -1;
+        }
+        realoffset = reader->size - offset;
+        break;
+    default:
+        snprintf(err->error, err->size, "Invalid whence.");
+        return -1;
+    }
+
+    if (realoffset > reader->size) {
+        snprintf(err->error, err->size, "Cannot seek past end of file.");
+        return -1;
+    }
+
+    /* Keep the read window when seeking forward within it. */
+    if (realoffset >= reader->win.pos && realoffset - reader->win.pos < (size_t) (reader->win.end - reader->win.cur))
+        reader->win.cur += realoffset - reader->win.pos;
+    else
+        window_reset(reader);
+
+    reader->win.pos = realoffset;
+    *pos            = realoffset;
+
+    return 0;
+}
+
+int sb_seek(SBReader *reader, size_t offset, SBWhence whence, size_t *pos, SBError *err)
+{
+    /* Views are only used by one thread, and their size never changes, so they need no lock. */
+    if (reader->parent != NULL)
+        return seek_cur(reader, offset, whence, pos, err);
+
+    lock_position(reader);
+    int ret = seek_cur(reader, offset, whence, pos, err);
+    unlock_position(reader);
+
+    waiters_wake(reader);
+
+    return ret;
+}
+
+/*
+ * Gives back the pages of [start, end) of a sparse mapped reader, once it is no longer
+ * part of any range. Only called after the ranges have been changed, so that a failed
+ * removal never zeroes data which is still in a range.
+ */
+static void removed_release(SBReader *reader, size_t start, size_t end)
+{
+#if defined(SB_POSIX)
+    if (reader->flags & SB_SPARSE_MAP)
+        sparse_release(reader, start, end);
+#else
+    (void) reader;
+    (void) start;
+    (void) end;
+#endif
+}
+
+static int remove_range(SBReader *reader, size_t start, size_t end, SBError *err)
+{
+    if (reader->parent != NULL) {
+        snprintf(err->error, err->size, "Cannot modify a view.");
+        return -1;
+    } else if (reader->read_only) {
+        snprintf(err->error, err->size, "Cannot modify a snapshot.");
+        return -1;
+    } else if (end >= reader->size || end < start) {
+        snprintf(err->error, err->size, "Invalid range.");
+        return -1;
+    }
+
+    ranges_changed(reader);
+    if (ranges_unshare(reader, err) < 0)
+        return -1;
+
+    for (Range *e = reader->ranges; e != NULL;) {
+        size_t rngstart = e->pos;
+        size_t rngend   = e->pos + e->size - 1;
+
+        /* Current range is after the deletion range. */
+        if (rngstart > end)
+            break;
+
+        /* Current range is before the deletion range. */
+        if (rngend < start) {
+            e = e->next;
+            continue;
+        }
+
+        /* Current range is entirely in the deletion range. */
+        if (rngstart >= start && rngend <= end) {
+            Range *next = e->next;
+            range_remove(reader, &reader->ranges, e->pos);
+            removed_release(reader, rngstart, rngend + 1);
+            e = next;
+            continue;
+        }
+
+        /* We need to split an existing range, since we're in between it. */
+        if (rngend > end && rngstart < start) {
+            Range *rng0 = reader->malloc(sizeof(Range));
+            if (rng0 == NULL) {
+                snprintf(err->error, err->size, "Could not allocate new range buffer.");
+                return -1;
+            }
+
+            rng0->pos       = end + 1;
+            rng0->size      = rngend + 1 - rng0->pos;
+            rng0->crc_valid = false;
+            rng0->used      = e->used;
+            if (data_mapped(reader, e->data)) {
+                rng0->data = e->data + end + 1 - rngstart;
+            } else {
+                rng0->data = data_alloc(reader, rng0->size);
+                if (rng0->data == NULL) {
+                    reader->free(rng0);
+                    snprintf(err->error, err->size, "Could not allocate new range data.");
+                    return -1;
+                }
+                copy_data(reader, rng0->data, e->data + end + 1 - rngstart, rng0->size);
+            }
+
+            range_insert_after(reader->ranges, rng0, e->pos);
+
+            e->size      = start - e->pos;
+            uint8_t *tmp = data_shrink(reader, e->data, e->size);
+            if (tmp == NULL) {
+                snprintf(err->error, err->size, "Could not realloc split range data.");
+                return -1;
+            }
+            e->data      = tmp;
+            e->crc_valid = false;
+
+            removed_release(reader, start, end + 1);
+
+            e = rng0->next;
+
+            continue;
+        }
+
+        /* Current range overlaps the start of the deletion range. */
+        if (rngstart < start) {
+            e->size      = start - e->pos;
+            uint8_t *tmp = data_shrink(reader, e->data, e->size);
+            if (tmp == NULL) {
+                snprintf(err->error, err->size, "Could not realloc reduced range data.");
+                return -1;
+            }
+            e->data      = tmp;
+            e->crc_valid = false;
+
+            removed_release(reader, start, rngend + 1);
+        }
+
+        /* current range overlaps the end of the deletion range. */
+        if (rngend > end) {
+            size_t oldSize = e->size;
+            e->size -= end + 1 - e->pos;
+            e->pos   = end + 1;
+
+            if (data_mapped(reader, e->data)) {
+                e->data     += oldSize - e->size;
+                e->crc_valid = false;
+                e            = e->next;
+                removed_release(reader, rngstart, end + 1);
+                continue;
+            }
+
+            uint8_t *newdata = data_alloc(reader, e->size);
+            if (newdata == NULL) {
+                snprintf(err->error, err->size, "Could not allocate new range data.");
+                return 1;
+            }
+            copy_data(reader, newdata, e->data + oldSize - e->size, e->size);
+
+            data_free(reader, e->data);
+
+            e->data      = newdata;
+            e->crc_valid = false;
+        }
+
+        e = e->next;
+    }
+
+    return 0;
+}
+
+/*
+ * Wakes only the threads in sb_read_wait(), and sends only the notifications, whose
+ * spans are now loaded, or past the end of the reader. Callbacks are called last,
+ * without any lock held.
+ */
+static void loaded_notify(SBReader *reader)
+{
+    if (reader->parent != NULL)
+        return;
+#if defined(SB_POSIX)
+    if (ATOMIC_LOAD(&reader->waiters) == NULL && ATOMIC_LOAD(&reader->notifies) == NULL)
+        return;
+#else
+    if (reader->notifies == NULL)
+        return;
+#endif
+
+    Notify *fired = NULL;
+
+    notify_lock(reader);
+    lock_shared(reader);
+
+#if defined(SB_POSIX)
+    for (Waiter *w = reader->waiters; w != NULL; w = w->next) {
+        if (w->end > reader->size || span_loaded(reader, w->start, w->end))
+            pthread_cond_signal(&w->cond);
+    }
+#endif
+
+    for (Notify *n = reader->notifies, *next; n != NULL; n = next) {
+        next = n->next;
+        if (n->end <= reader->size && !span_loaded(reader, n->start, n->end))
+            continue;
+
+        notify_unlink(reader, n);
+        n->prev = NULL;
+        n->next = NULL;
+        if (n->func != NULL) {
+            n->next = fired;
+            fired   = n;
+        } else if (reader->ready == NULL) {
+            reader->ready      = n;
+            reader->ready_tail = n;
+            event_fd_signal(reader);
+        } else {
+            reader->ready_tail->next = n;
+            reader->ready_tail       = n;
+        }
+    }
+
+    unlock(reader);
+    notify_unlock(reader);
+
+    while (fired != NULL) {
+        Notify *next = fired->next;
+        fired->func(fired->opaque);
+        reader->free(fired);
+        fired = next;
+    }
+}
+
+/* Checks if range data is held in memory, rather than mapped or spilled. */
+static bool data_resident(SBReader *reader, uint8_t *data)
+{
+    return !data_mapped(reader, data) && data_header(data)->spill == NULL;
+}
+
+#if defined(SB_POSIX)
+/* Writes exactly len bytes at off in a file, retrying short writes. */
+static int fd_write(int fd, const uint8_t *buf, uint64_t off, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t) off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        off += (uint64_t) n;
+        len -= (size_t) n;
+    }
+
+    return 0;
+}
+
+/*
+ * Moves a range's data to the spill file, and maps it back from there, so that it is
+ * paged in from the file when read, and its pages may be dropped under memory pressure.
+ * Only the data is spilled. Its header is kept at the end of an anonymous page mapped
+ * just before it, so that changing its count of uses never writes to the file.
+ */
+static int spill_range(SBReader *reader, Range *e)
+{
+    SpillFile *sf   = reader->spill;
+    size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t len      = (e->size + pagesize - 1) & ~(pagesize - 1);
+    uint64_t off    = spill_take(sf, len);
+
+    if (fd_write(sf->fd, e->data, off, e->size) < 0) {
+        spill_give(sf, off, len);
+        return -1;
+    }
+
+    uint8_t *p = mmap(NULL, pagesize + len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        spill_give(sf, off, len);
+        return -1;
+    }
+    if (mmap(p + pagesize, len, PROT_READ, MAP_SHARED | MAP_FIXED, sf->fd, (off_t) off) == MAP_FAILED) {
+        munmap(p, pagesize + len);
+        spill_give(sf, off, len);
+        return -1;
+    }
+
+    DataHeader *h = data_header(p + pagesize);
+    h->refs       = 1;
+    h->spill      = sf;
+    h->spill_off  = off;
+    h->spill_len  = len;
+
+    ATOMIC_ADD(&sf->refs, 1);
+
+    data_free(reader, e->data);
+    e->data = p + pagesize;
+
+    return 0;
+}
+#endif
+
+/*
+ * Spills the least recently used range data until no more than the spill limit is held
+ * in memory. Data shared with snapshots or clones is left alone, since spilling it would
+ * not free it. This is best effort, and leaves the rest in memory if the file cannot be
+ * written to.
+ */
+static void spill(SBReader *reader)
+{
+#if defined(SB_POSIX)
+    if (reader->spill == NULL)
+        return;
+
+    reader->spill_clock++;
+
+    size_t resident = 0;
+    for (Range *e = reader->ranges; e != NULL; e = e->next) {
+        if (data_resident(reader, e->data))
+            resident += e->size;
+    }
+    if (resident <= reader->spill_limit)
+        return;
+
+    char msg[1];
+    SBError err = { &msg[0], 1 };
+    if (ranges_unshare(reader, &err) < 0 || retire_reserve(reader, &err) < 0)
+        return;
+    ranges_changed(reader);
+
+    while (resident > reader->spill_limit) {
+        Range *cold = NULL;
+        for (Range *r = reader->ranges; r != NULL; r = r->next) {
+            if (data_resident(reader, r->data) && ATOMIC_LOAD(&data_header(r->data)->refs) == 1 &&
+                (cold == NULL || r->used < cold->used))
+                cold = r;
+        }
+        if (cold == NULL || spill_range(reader, cold) < 0)
+            break;
+        resident -= cold->size;
+    }
+#else
+    (void) reader;
+#endif
+}
+
+int sb_load_range(SBReader *reader, size_t pos, uint8_t *buf, size_t bufsize, SBError *err)
+{
+    lock_exclusive(reader);
+    int ret = retire_reserve(reader, err);
+    if (ret == 0) {
+        ret = load_range(reader, pos, buf, bufsize, err);
+        spill(reader);
+        if (publish(reader, err) < 0)
+            ret = -1;
+    }
+    unlock(reader);
+
+    loaded_notify(reader);
+
+    return ret;
+}
+
+#if defined(SB_POSIX)
+/* Reads exactly len bytes at off in a file, retrying short reads. */
+static int fd_read(int fd, uint8_t *buf, uint64_t off, size_t len, SBError *err)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, (off_t) off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            snprintf(err->error, err->size, "Could not read file: %s.", strerror(errno));
+            return -1;
+        } else if (n == 0) {
+            snprintf(err->error, err->size, "File ends before the range to load.");
+            return -1;
+        }
+        buf += n;
+        off += (uint64_t) n;
+        len -= (size_t) n;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns a range ending at pos which may be grown in place to take len more bytes, or
+ * NULL. Thread-safe readers never grow ranges, so that files are not read under the lock.
+ */
+static Range *range_extendable(SBReader *reader, size_t pos, size_t len)
+{
+    if (reader->flags & SB_THREAD_SAFE)
+        return NULL;
+
+    for (Range *e = reader->ranges; e != NULL && e->pos < pos; e = e->next) {
+        if (e->pos + e->size != pos)
+            continue;
+        if (data_mapped(reader, e->data) || ATOMIC_LOAD(&data_header(e->data)->refs) != 1 ||
+            data_header(e->data)->spill != NULL)
+            return NULL;
+        if (e->next != NULL && e->next->pos <= pos + len)
+            return NULL;
+        return e;
+    }
+
+    return NULL;
+}
+
+static int load_fd(SBReader *reader, size_t pos, int fd, uint64_t file_off, size_t len, SBError *err)
+{
+    if (load_check(reader, pos, len, err) < 0)
+        return -1;
+
+    Range *e = range_extendable(reader, pos, len);
+    if (e != NULL) {
+        uint8_t *p = reader->realloc(data_header(e->data), DATA_HEADER_SIZE + e->size + len);
+        if (p == NULL) {
+            snprintf(err->error, err->size, "Could not grow range.");
+            return -1;
+        }
+        e->data = p + DATA_HEADER_SIZE;
+
+        /* A failed read leaves the range as it was, in a larger buffer. */
+        if (fd_read(fd, e->data + e->size, file_off, len, err) < 0)
+            return -1;
+
+        e->size     += len;
+        e->crc_valid = false;
+        return 0;
+    }
+
+    uint8_t *data = data_alloc(reader, len);
+    if (data == NULL) {
+        snprintf(err->error, err->size, "Could not allocate buffer for spares list entry.");
+        return -1;
+    }
+    if (fd_read(fd, data, file_off, len, err) < 0) {
+        data_destroy(reader, data);
+        return -1;
+    }
+
+    return range_add(reader, pos, data, len, err);
+}
+#endif
+
+int sb_load_from_fd(SBReader *reader, size_t pos, int fd, uint64_t file_off, size_t len, SBError *err)
+{
+#if defined(SB_POSIX)
+    if (reader->flags & SB_THREAD_SAFE) {
+        /* Read before taking the lock, which only covers adding the range. */
+        if (len == 0) {
+            snprintf(err->error, err->size, "Invalid buffer size.");
+            return -1;
+        }
+        uint8_t *data = data_alloc(reader, len);
+        if (data == NULL) {
+            snprintf(err->error, err->size, "Could not allocate buffer for spares list entry.");
+            return -1;
+        }
+        if (fd_read(fd, data, file_off, len, err) < 0) {
+            data_destroy(reader, data);
+            return -1;
+        }
+
+        lock_exclusive(reader);
+        int ret = retire_reserve(reader, err);
+        if (ret == 0)
+            ret = load_check(reader, pos, len, err);
+        if (ret == 0) {
+            ret = range_add(reader, pos, data, len, err);
+            spill(reader);
+            if (publish(reader, err) < 0)
+                ret = -1;
+        } else {
+            data_destroy(reader, data);
+        }
+        unlock(reader);
+
+        loaded_notify(reader);
+
+        return ret;
+    }
+
+    int ret = load_fd(reader, pos, fd, file_off, len, err);
+    spill(reader);
+
+    loaded_notify(reader);
+
+    return ret;
+#else
+    (void) reader;
+    (void) pos;
+    (void) fd;
+    (void) file_off;
+    (void) len;
+    snprintf(err->error, err->size, "Loading from file descriptors is not supported on this platform.");
+    return -1;
+#endif
+}
+
+#if defined(SB_POSIX)
+#if defined(SB_IO_URING)
+/* The most reads in flight in a batch. */
+#define RING_ENTRIES 64
+
+/* How long to wait for reads still in flight after a failure, in milliseconds. */
+#define RING_DRAIN_TIMEOUT 5000
+
+/* A minimal io_uring, driven through the raw syscalls so liburing is not needed. */
+typedef struct Ring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_len;
+    size_t cq_map_len;
+    size_t sqes_len;
+} Ring;
+
+static int ring_init(Ring *ring, unsigned int entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->entries    = p.sq_entries;
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len   = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_map_len > ring->sq_map_len)
+        ring->sq_map_len = ring->cq_map_len;
+
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+        goto fail_sq;
+
+    ring->cq_map = ring->sq_map;
+    if (!single) {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+            goto fail_cq;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_sqes;
+
+    uint8_t *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_tail  = (unsigned int *) (sq + p.sq_off.tail);
+    ring->sq_mask  = (unsigned int *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+    ring->cq_head  = (unsigned int *) (cq + p.cq_off.head);
+    ring->cq_tail  = (unsigned int *) (cq + p.cq_off.tail);
+    ring->cq_mask  = (unsigned int *) (cq + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 0;
+
+fail_sqes:
+    if (!single)
+        munmap(ring->cq_map, ring->cq_map_len);
+fail_cq:
+    munmap(ring->sq_map, ring->sq_map_len);
+fail_sq:
+    close(ring->fd);
+    return -1;
+}
+
+static void ring_free(Ring *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
+
+/*
+ * Reads every job into its data through io_uring. Reads which fail, or come up
+ * short, are finished with pread(), which reports any real error. Returns 1 if
+ * io_uring is not available, so that nothing has been read.
+ */
+static int batch_read_ring(SBReader *reader, uint8_t **data, const SBLoadJob *jobs, size_t n, SBError *err)
+{
+    Ring ring;
+    if (ring_init(&ring, n < RING_ENTRIES ? (unsigned int) n : RING_ENTRIES) < 0)
+        return 1;
+
+    struct iovec *iov = reader->malloc(n * sizeof(*iov));
+    if (iov == NULL) {
+        ring_free(&ring);
+        snprintf(err->error, err->size, "Could not allocate read vectors.");
+        return -1;
+    }
+
+    int ret          = 0;
+    size_t next      = 0;
+    size_t inflight  = 0;
+    size_t pending   = 0; /* Queued, but not yet taken by the kernel. */
+    unsigned int tail = *ring.sq_tail;
+    while ((ret == 0 && next < n) || inflight + pending > 0) {
+        while (ret == 0 && next < n && inflight + pending < ring.entries) {
+            unsigned int idx         = tail & *ring.sq_mask;
+            struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+            iov[next].iov_base = data[next];
+            iov[next].iov_len  = jobs[next].len;
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode    = IORING_OP_READV;
+            sqe->fd        = jobs[next].fd;
+            sqe->off       = jobs[next].file_off;
+            sqe->addr      = (uint64_t) (uintptr_t) &iov[next];
+            sqe->len       = 1;
+            sqe->user_data = next;
+
+            ring.sq_array[idx] = idx;
+            tail++;
+            next++;
+            pending++;
+        }
+        ATOMIC_STORE(ring.sq_tail, tail);
+
+        int got = (int) syscall(__NR_io_uring_enter, ring.fd, (unsigned int) pending, 1,
+                                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (got < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            /* Only possible if the ring itself is broken, so submit nothing more. */
+            if (ret == 0)
+                snprintf(err->error, err->size, "Could not submit reads: %s.", strerror(errno));
+            ret = -1;
+            break;
+        } else if (got > 0) {
+            pending  -= (size_t) got;
+            inflight += (size_t) got;
+        }
+
+        unsigned int head = *ring.cq_head;
+        while (head != ATOMIC_LOAD(ring.cq_tail)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            size_t i                 = (size_t) cqe->user_data;
+            size_t done              = cqe->res > 0 ? (size_t) cqe->res : 0;
+
+            if (ret == 0 && done < jobs[i].len &&
+                fd_read(jobs[i].fd, data[i] + done, jobs[i].file_off + done, jobs[i].len - done, err) < 0)
+                ret = -1;
+
+            iov[i].iov_base = NULL; /* Marks the read as complete. */
+            head++;
+            inflight--;
+        }
+        ATOMIC_STORE(ring.cq_head, head);
+    }
+
+    /*
+     * Reads the kernel has already taken may still write into their buffers, which are
+     * freed on error, so wait for them to complete first. This cannot hang in practice:
+     * the kernel finishes a read it has taken whether or not the ring can still take
+     * new ones, and reads of files always complete. Only a read of a pipe or socket
+     * with no data coming could be left, so the wait is bounded all the same, and the
+     * buffers of reads still in flight are then handed back as NULL, to be leaked
+     * rather than freed.
+     */
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (inflight > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = (long) (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (waited >= RING_DRAIN_TIMEOUT)
+            break;
+
+        struct pollfd pfd = { .fd = ring.fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int) (RING_DRAIN_TIMEOUT - waited)) < 0)
+            sched_yield();
+
+        unsigned int head = *ring.cq_head;
+        for (; head != ATOMIC_LOAD(ring.cq_tail); head++) {
+            iov[ring.cqes[head & *ring.cq_mask].user_data].iov_base = NULL;
+            inflight--;
+        }
+        ATOMIC_STORE(ring.cq_head, head);
+    }
+
+    if (inflight > 0) {
+        /* The last reads queued were never taken, so cannot be in flight. */
+        for (size_t i = 0; i < next - pending; i++) {
+            if (iov[i].iov_base != NULL)
+                data[i] = NULL;
+        }
+        snprintf(err->error, err->size, "Reads did not complete after a failure, leaking their buffers.");
+        ring_free(&ring);
+        return -1; /* The kernel may still read the vectors too. */
+    }
+
+    reader->free(iov);
+    ring_free(&ring);
+
+    return ret;
+}
+#endif
+
+/* Reads every job into its data. */
+static int batch_read(SBReader *reader, uint8_t **data, const SBLoadJob *jobs, size_t n, SBLoadMethod method,
+                      SBError *err)
+{
+    if (method != SB_LOAD_PREAD) {
+        int ret = 1;
+#if defined(SB_IO_URING)
+        ret = batch_read_ring(reader, data, jobs, n, err);
+#endif
+        if (ret <= 0)
+            return ret;
+        if (method == SB_LOAD_IO_URING) {
+            snprintf(err->error, err->size, "io_uring is not available.");
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (fd_read(jobs[i].fd, data[i], jobs[i].file_off, jobs[i].len, err) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int load_batch(SBReader *reader, uint8_t **data, const SBLoadJob *jobs, size_t n, SBError *err)
+{
+    size_t added = 0;
+    int ret      = 0;
+
+    for (size_t i = 0; i < n && ret == 0; i++)
+        ret = load_check(reader, jobs[i].pos, jobs[i].len, err);
+
+    /* Each range added may retire more range data, so reserve room before each. */
+    for (; added < n && ret == 0; added++) {
+        ret = retire_reserve(reader, err);
+        if (ret == 0)
+            ret = range_add(reader, jobs[added].pos, data[added], jobs[added].len, err);
+        else
+            data_destroy(reader, data[added]);
+    }
+
+    /* range_add() takes the data even when it fails. */
+    for (; added < n; added++)
+        data_destroy(reader, data[added]);
+
+    return ret;
+}
+#endif
+
+int sb_load_batch(SBReader *reader, const SBLoadJob *jobs, size_t n, SBLoadMethod method, SBError *err)
+{
+#if defined(SB_POSIX)
+    if (n == 0)
+        return 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (jobs[i].len == 0) {
+            snprintf(err->error, err->size, "Invalid buffer size.");
+            return -1;
+        }
+    }
+
+    uint8_t **data = reader->malloc(n * sizeof(*data));
+    if (data == NULL) {
+        snprintf(err->error, err->size, "Could not allocate batch.");
+        return -1;
+    }
+
+    size_t allocated;
+    for (allocated = 0; allocated < n; allocated++) {
+        data[allocated] = data_alloc(reader, jobs[allocated].len);
+        if (data[allocated] == NULL)
+            break;
+    }
+
+    int ret = -1;
+    if (allocated < n)
+        snprintf(err->error, err->size, "Could not allocate buffer for spares list entry.");
+    else
+        ret = batch_read(reader, data, jobs, n, method, err);
+
+    if (ret < 0) {
+        /* Buffers still being read into are NULL, and left to leak. */
+        for (size_t i = 0; i < allocated; i++) {
+            if (data[i] != NULL)
+                data_destroy(reader, data[i]);
+        }
+        reader->free(data);
+        return -1;
+    }
+
+    lock_exclusive(reader);
+    ret = load_batch(reader, data, jobs, n, err);
+    spill(reader);
+    if (publish(reader, err) < 0)
+        ret = -1;
+    unlock(reader);
+
+    reader->free(data);
+
+    loaded_notify(reader);
+
+    return ret;
+#else
+    (void) reader;
+    (void) jobs;
+    (void) n;
+    (void) method;
+    snprintf(err->error, err->size, "Loading from file descriptors is not supported on this platform.");
+    return -1;
+#endif
+}
+
+int sb_map_file(SBReader *reader, int fd, SBError *err)
+{
+#if defined(SB_POSIX)
+    if (reader->parent != NULL) {
+        snprintf(err->error, err->size, "Cannot modify a view.");
+        return -1;
+    } else if (reader->read_only) {
+        snprintf(err->error, err->size, "Cannot modify a snapshot.");
+        return -1;
+    } else if (reader->flags & SB_SPARSE_MAP) {
+        snprintf(err->error, err->size, "Cannot map a file into a sparse mapped reader.");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        snprintf(err->error, err->size, "Could not stat file: %s.", strerror(errno));
+        return -1;
+    } else if (st.st_size <= 0 || (uint64_t) st.st_size > SIZE_MAX) {
+        snprintf(err->error, err->size, "Invalid file size for mapping.");
+        return -1;
+    }
+
+    FileMap *map = reader->malloc(sizeof(*map));
+    if (map == NULL) {
+        snprintf(err->error, err->size, "Could not allocate file mapping.");
+        return -1;
+    }
+    map->refs = 1;
+    map->size = (size_t) st.st_size;
+    map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map->base == MAP_FAILED) {
+        reader->free(map);
+        snprintf(err->error, err->size, "Could not map file: %s.", strerror(errno));
+        return -1;
+    }
+
+    lock_exclusive(reader);
+    if (reader->map != NULL) {
+        unlock(reader);
+        munmap(map->base, map->size);
+        reader->free(map);
+        snprintf(err->error, err->size, "A file is already mapped.");
+        return -1;
+    }
+    reader->map = map;
+    unlock(reader);
+
+    return 0;
+#else
+    (void) reader;
+    (void) fd;
+    snprintf(err->error, err->size, "Mapping files is not supported on this platform.");
+    return -1;
+#endif
+}
+
+static int load_mapped(SBReader *reader, size_t pos, size_t map_off, size_t len, SBError *err)
+{
+    if (reader->map == NULL || (reader->flags & SB_SPARSE_MAP)) {
+        snprintf(err->error, err->size, "No file is mapped.");
+        return -1;
+    } else if (map_off > reader->map->size || len > reader->map->size - map_off) {
+        snprintf(err->error, err->size, "Cannot load a range passed the end of the mapped file.");
+        return -1;
+    }
+
+    if (load_check(reader, pos, len, err) < 0)
+        return -1;
+
+    uint8_t *data = reader->map->base + map_off;
+
+    /* Grow a mapped range which this continues, both in the reader and in the file. */
+    for (Range *e = reader->ranges; e != NULL && e->pos < pos; e = e->next) {
+        if (e->pos + e->size != pos)
+            continue;
+        if (data_mapped(reader, e->data) && e->data + e->size == data &&
+            (e->next == NULL || e->next->pos > pos + len)) {
+            e->size     += len;
+            e->crc_valid = false;
+            return 0;
+        }
+        break;
+    }
+
+    return range_add(reader, pos, data, len, err);
+}
+
+int sb_load_mapped(SBReader *reader, size_t pos, size_t map_off, size_t len, SBError *err)
+{
+    lock_exclusive(reader);
+    int ret = retire_reserve(reader, err);
+    if (ret == 0) {
+        ret = load_mapped(reader, pos, map_off, len, err);
+        if (publish(reader, err) < 0)
+            ret = -1;
+    }
+    unlock(reader);
+
+    loaded_notify(reader);
+
+    return ret;
+}
+
+int sb_remove_range(SBReader *reader, size_t start, size_t end, SBError *err)
+{
+    lock_exclusive(reader);
+    int ret = retire_reserve(reader, err);
+    if (ret == 0) {
+        ret = remove_range(reader, start, end, err);
+        if (publish(reader, err) < 0)
+            ret = -1;
+    }
+    unlock(reader);
+
+    return ret;
+}
+
+static int resize(SBReader *reader, size_t newsize, SBError *err)
+{
+    if (reader->parent != NULL) {
+        snprintf(err->error, err->size, "Cannot modify a view.");
+        return -1;
+    } else if (reader->read_only) {
+        snprintf(err->error, err->size, "Cannot modify a snapshot.");
+        return -1;
+    } else if (newsize == 0) {
+        snprintf(err->error, err->size, "Cannot resize to zero size.");
+        return -1;
+    }
+
+    if (newsize < reader->size) {
+        int ret = remove_range(reader, newsize, reader->size - 1, err);
+        if (ret < 0)
+            return ret;
+        if (reader->win.pos > newsize)
+            reader->win.pos = newsize;
+    }
+#if defined(SB_POSIX)
+    if ((reader->flags & SB_SPARSE_MAP) && sparse_grow(reader, newsize, err) < 0)
+        return -1;
+#endif
+
+    reader->size = newsize;
+
+    return 0;
+}
+
+int sb_resize(SBReader *reader, size_t newsize, SBError *err)
+{
+    lock_exclusive(reader);
+    int ret = retire_reserve(reader, err);
+    if (ret == 0) {
+        ret = resize(reader, newsize, err);
+        if (publish(reader, err) < 0)
+            ret = -1;
+    }
+    unlock(reader);
+
+    loaded_notify(reader);
+
+    return ret;
+}
+
+/*
+ * Adds a hole to the list of holes, bridging it with the previous one if the gap is small
+ * enough. Holes which touch, as they may across shards, are always joined.
+ */
+static void hole_add(SBRange *hole, bool *pending, size_t start, size_t end, size_t threshold,
+                     SBRange *out, size_t max, size_t *nb)
+{
+    if (*pending && (start == hole->pos + hole->size || start - (hole->pos + hole->size) < threshold)) {
+        hole->size = end - hole->pos;
+        return;
+    }
+
+    if (*pending) {
+        if (*nb < max)
+            out[*nb] = *hole;
+        (*nb)++;
+    }
+
+    hole->pos  = start;
+    hole->size = end - start;
+    *pending   = true;
+}
+
+static int missing_ranges(SBReader *reader, size_t off, size_t len, SBRange *out, size_t max,
+                          size_t gap_merge_threshold, size_t *count, SBError *err)
+{
+    if (len == 0 || off + len > reader->size || off + len < off) {
+        snprintf(err->error, err->size, "Invalid range.");
+        return -1;
+    }
+
+    size_t base;
+    reader = root_get(reader, &base);
+    off   += base;
+
+    size_t end   = off + len;
+    size_t cur   = off;
+    size_t nb    = 0;
+    bool pending = false;
+    SBRange hole = { 0 };
+    for (Range *e = reader->ranges; e != NULL && cur < end; e = e->next) {
+        if (e->pos + e->size <= cur)
+            continue;
+        if (e->pos >= end)
+            break;
+
+        if (e->pos > cur)
+            hole_add(&hole, &pending, cur, e->pos, gap_merge_threshold, out, max, &nb);
+
+        cur = e->pos + e->size;
+    }
+
+    /* Trailing hole until the end of the span. */
+    if (cur < end)
+        hole_add(&hole, &pending, cur, end, gap_merge_threshold, out, max, &nb);
+
+    if (pending) {
+        if (nb < max)
+            out[nb] = hole;
+        nb++;
+    }
+
+    for (size_t i = 0; i < nb && i < max; i++)
+        out[i].pos -= base;
+
+    *count = nb;
+
+    return 0;
+}
+
+int sb_missing_ranges(SBReader *reader, size_t off, size_t len, SBRange *out, size_t max,
+                      size_t gap_merge_threshold, size_t *count, SBError *err)
+{
+    lock_shared(reader);
+    int ret = missing_ranges(reader, off, len, out, max, gap_merge_threshold, count, err);
+    unlock(reader);
+
+    return ret;
+}
+
+/*
+ * Bitstream reader.
+ */
+
+static uint64_t rb64(const uint8_t *p)
+{
+    return (uint64_t) p[0] << 56 | (uint64_t) p[1] << 48 | (uint64_t) p[2] << 40 | (uint64_t) p[3] << 32 |
+           (uint64_t) p[4] << 24 | (uint64_t) p[5] << 16 | (uint64_t) p[6] << 8 | p[7];
+}
+
+static unsigned int clz64(uint64_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(v);
+#else
+    unsigned int n = 0;
+    for (; !(v & (UINT64_C(1) << 63)); v <<= 1)
+        n++;
+    return n;
+#endif
+}
+
+/*
+ * Tops up the bit cache with as many whole bytes as fit. Eight bytes are always
+ * loaded, and bits past the ones accounted for are real stream bits, or zero past
+ * the end, so OR-ing them in again on the next refill is harmless.
+ */
+static void bits_refill(SBBitReader *br)
+{
+    SBReader *reader = br->reader;
+    size_t left      = br->end - br->pos;
+    size_t nbytes    = (64 - br->bits) / 8;
+
+    if (nbytes == 0 || left == 0)
+        return;
+    if (nbytes > left)
+        nbytes = left;
+
+    lock_shared(reader);
+
+    Range *e = range_find(hint_get(reader, br->hint, br->gen, br->pos), br->pos);
+
+    br->hint = e;
+    br->gen  = reader->gen;
+
+    /* Load straight from the range when possible, and fall back to a zero padded copy. */
+    uint8_t tmp[8];
+    const uint8_t *p;
+    if (left >= 8 && e != NULL && e->pos <= br->pos && e->pos + e->size - br->pos >= 8) {
+        p = e->data + (br->pos - e->pos);
+    } else {
+        size_t n = left < 8 ? left : 8;
+        read_at(reader, e, br->pos, &tmp[0], n);
+        memset(&tmp[n], 0, 8 - n);
+        p = &tmp[0];
+    }
+
+    br->cache |= rb64(p) >> br->bits;
+    br->pos   += nbytes;
+    br->bits  += nbytes * 8;
+
+    unlock(reader);
+}
+
+/* Consumes n <= 57 bits. */
+static int bits_get(SBBitReader *br, unsigned int n, uint64_t *val, SBError *err)
+{
+    if (br->bits < n)
+        bits_refill(br);
+    if (br->bits < n) {
+        snprintf(err->error, err->size, "Cannot read past end of bitstream.");
+        return -1;
+    }
+
+    *val = n == 0 ? 0 : br->cache >> (64 - n);
+    br->cache <<= n;
+    br->bits   -= n;
+
+    return 0;
+}
+
+int sb_bitreader_init(SBBitReader *br, SBReader *reader, size_t off, size_t len, SBError *err)
+{
+    lock_shared(reader);
+    size_t size = reader->size;
+    unlock(reader);
+
+    if (off > size || len > size - off) {
+        snprintf(err->error, err->size, "Invalid range.");
+        return -1;
+    }
+
+    size_t base;
+    reader = root_get(reader, &base);
+    off   += base;
+
+    br->reader = reader;
+    br->start  = off;
+    br->pos    = off;
+    br->end    = off + len;
+    br->cache  = 0;
+    br->bits   = 0;
+    br->hint   = NULL;
+    br->gen    = 0;
+
+    return 0;
+}
+
+int sb_bitreader_read(SBBitReader *br, unsigned int n, uint64_t *val, SBError *err)
+{
+    if (n > 64) {
+        snprintf(err->error, err->size, "Cannot read more than 64 bits at once.");
+        return -1;
+    }
+
+    if (n <= 32)
+        return bits_get(br, n, val, err);
+
+    uint64_t hi, lo;
+    int ret = bits_get(br, n - 32, &hi, err);
+    if (ret < 0)
+        return ret;
+    ret = bits_get(br, 32, &lo, err);
+    if (ret < 0)
+        return ret;
+
+    *val = hi << 32 | lo;
+
+    return 0;
+}
+
+int sb_bitreader_skip(SBBitReader *br, size_t n, SBError *err)
+{
+    if (n > sb_bitreader_left(br)) {
+        snprintf(err->error, err->size, "Cannot skip past end of bitstream.");
+        return -1;
+    }
+
+    if (n <= br->bits) {
+        br->cache = n == 64 ? 0 : br->cache << n;
+        br->bits -= n;
+        return 0;
+    }
+
+    /* Drop the cache and skip whole bytes without loading them. */
+    n        -= br->bits;
+    br->cache = 0;
+    br->bits  = 0;
+    br->pos  += n / 8;
+
+    uint64_t dummy;
+    return bits_get(br, n % 8, &dummy, err);
+}
+
+int sb_bitreader_read_ue(SBBitReader *br, uint64_t *val, SBError *err)
+{
+    unsigned int lz = 0;
+
+    for (;;) {
+        bits_refill(br);
+        if (br->bits == 0) {
+            snprintf(err->error, err->size, "Cannot read past end of bitstream.");
+            return -1;
+        }
+
+        unsigned int n = br->cache == 0 ? 64 : clz64(br->cache);
+        if (n < br->bits) {
+            lz += n;
+            br->cache <<= n;
+            br->bits   -= n;
+            break;
+        }
+
+        lz       += br->bits;
+        br->cache = 0;
+        br->bits  = 0;
+        if (lz > 63)
+            break;
+    }
+
+    if (lz > 63) {
+        snprintf(err->error, err->size, "Invalid Exp-Golomb code.");
+        return -1;
+    }
+
+    uint64_t rest;
+    int ret = sb_bitreader_read(br, lz + 1, &rest, err);
+    if (ret < 0)
+        return ret;
+
+    *val = rest - 1;
+
+    return 0;
+}
+
+int sb_bitreader_read_se(SBBitReader *br, int64_t *val, SBError *err)
+{
+    uint64_t k;
+
+    int ret = sb_bitreader_read_ue(br, &k, err);
+    if (ret < 0)
+        return ret;
+
+    if (k & 1)
+        *val = (int64_t) (k / 2 + 1);
+    else
+        *val = -(int64_t) (k / 2);
+
+    return 0;
+}
+
+int sb_bitreader_align(SBBitReader *br, SBError *err)
+{
+    return sb_bitreader_skip(br, br->bits % 8, err);
+}
+
+size_t sb_bitreader_tell(SBBitReader *br)
+{
+    return (br->pos - br->start) * 8 - br->bits;
+}
+
+size_t sb_bitreader_left(SBBitReader *br)
+{
+    return (br->end - br->pos) * 8 + br->bits;
+}
+
+/*
+ * Pattern search.
+ */
+
+static unsigned int ctz32(uint32_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(v);
+#else
+    unsigned int n = 0;
+    for (; !(v & 1); v >>= 1)
+        n++;
+    return n;
+#endif
+}
+
+static const uint8_t *find_scalar(const uint8_t *hay, size_t hlen, const uint8_t *needle, size_t nlen)
+{
+    const uint8_t *p   = hay;
+    const uint8_t *end = hay + hlen;
+
+    while ((size_t) (end - p) >= nlen) {
+        p = memchr(p, needle[0], end - p - nlen + 1);
+        if (p == NULL)
+            return NULL;
+        if (!memcmp(p + 1, needle + 1, nlen - 1))
+            return p;
+        p++;
+    }
+
+    return NULL;
+}
+
+#if defined(SB_X86_SIMD)
+/*
+ * Candidate positions are the ones where both the first and last byte of the needle
+ * match, which rules out nearly all of them in one pair of vector compares.
+ */
+__attribute__((target("sse2")))
+static const uint8_t *find_sse2(const uint8_t *hay, size_t hlen, const uint8_t *needle, size_t nlen)
+{
+    const __m128i first = _mm_set1_epi8((char) needle[0]);
+    const __m128i last  = _mm_set1_epi8((char) needle[nlen - 1]);
+    size_t i;
+
+    for (i = 0; i + nlen - 1 + 16 <= hlen; i += 16) {
+        __m128i a     = _mm_loadu_si128((const __m128i *) (hay + i));
+        __m128i b     = _mm_loadu_si128((const __m128i *) (hay + i + nlen - 1));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            unsigned int bit = ctz32(mask);
+            if (!memcmp(hay + i + bit + 1, needle + 1, nlen - 1))
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(hay + i, hlen - i, needle, nlen);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *find_avx2(const uint8_t *hay, size_t hlen, const uint8_t *needle, size_t nlen)
+{
+    const __m256i first = _mm256_set1_epi8((char) needle[0]);
+    const __m256i last  = _mm256_set1_epi8((char) needle[nlen - 1]);
+    size_t i;
+
+    for (i = 0; i + nlen - 1 + 32 <= hlen; i += 32) {
+        __m256i a     = _mm256_loadu_si256((const __m256i *) (hay + i));
+        __m256i b     = _mm256_loadu_si256((const __m256i *) (hay + i + nlen - 1));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            unsigned int bit = ctz32(mask);
+            if (!memcmp(hay + i + bit + 1, needle + 1, nlen - 1))
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    return find_sse2(hay + i, hlen - i, needle, nlen);
+}
+#endif
+
+/* Finds the first occurence of needle in hay, or NULL. */
+static const uint8_t *find_mem(const uint8_t *hay, size_t hlen, const uint8_t *needle, size_t nlen)
+{
+    if (hlen < nlen)
+        return NULL;
+    if (nlen == 1)
+        return memchr(hay, needle[0], hlen);
+
+#if defined(SB_X86_SIMD)
+    if (__builtin_cpu_supports("avx2"))
+        return find_avx2(hay, hlen, needle, nlen);
+    if (__builtin_cpu_supports("sse2"))
+        return find_sse2(hay, hlen, needle, nlen);
+#endif
+
+    return find_scalar(hay, hlen, needle, nlen);
+}
+
+static int find_pattern(SBReader *reader, size_t off, size_t len, const uint8_t *needle, size_t needle_len,
+                        size_t *found, SBError *err)
+{
+    if (off > reader->size || len > reader->size - off) {
+        snprintf(err->error, err->size, "Invalid range.");
+        return -1;
+    } else if (needle_len == 0) {
+        snprintf(err->error, err->size, "Invalid needle size.");
+        return -1;
+    }
+
+    if (needle_len > len)
+        return 0;
+
+    size_t base;
+    reader = root_get(reader, &base);
+    off   += base;
+
+    /* Holes read as zeroes, so only an all zero needle can match inside one. */
+    bool zeroes = true;
+    for (size_t i = 0; i < needle_len && zeroes; i++)
+        zeroes = needle[i] == 0;
+
+    uint8_t *tmp = NULL;
+    if (needle_len > 1) {
+        tmp = reader->malloc(2 * (needle_len - 1));
+        if (tmp == NULL) {
+            snprintf(err->error, err->size, "Could not allocate search buffer.");
+            return -1;
+        }
+    }
+
+    /*
+     * Matches starting in each extent are checked in order: first the ones which lie
+     * entirely inside it, then the ones which straddle its end, using a copy of the
+     * bytes around the boundary.
+     */
+    size_t end = off + len;
+    int ret    = 0;
+    Range *e   = reader->ranges;
+    for (size_t cur = off; cur < end && ret == 0;) {
+        Extent ext;
+        e = extent_get(e, cur, end, &ext);
+
+        if (ext.size >= needle_len) {
+            if (ext.data != NULL) {
+                const uint8_t *p = find_mem(ext.data, ext.size, needle, needle_len);
+                if (p != NULL) {
+                    *found = ext.pos + (p - ext.data) - base;
+                    ret    = 1;
+                    break;
+                }
+            } else if (zeroes) {
+                *found = ext.pos - base;
+                ret    = 1;
+                break;
+            }
+        }
+
+        cur = ext.pos + ext.size;
+        if (needle_len > 1 && cur < end) {
+            size_t start = ext.size >= needle_len - 1 ? cur - (needle_len - 1) : ext.pos;
+            size_t stop  = end - cur > needle_len - 1 ? cur + needle_len - 1 : end;
+
+            read_at(reader, e, start, tmp, stop - start);
+            const uint8_t *p = find_mem(tmp, stop - start, needle, needle_len);
+            if (p != NULL) {
+                *found = start + (p - tmp) - base;
+                ret    = 1;
+            }
+        }
+    }
+
+    if (tmp != NULL)
+        reader->free(tmp);
+
+    return ret;
+}
+
+int sb_find(SBReader *reader, size_t off, size_t len, const uint8_t *needle, size_t needle_len,
+            size_t *found, SBError *err)
 {
-    SBReader *ret;
+    lock_shared(reader);
+    int ret = find_pattern(reader, off, len, needle, needle_len, found, err);
+    unlock(reader);
 
-    if (size == 0) {
-        snprintf(err->error, err->size, "Invalid reader size.");
-        return NULL;
+    return ret;
+}
+
+/*
+ * Annex B start code scanning.
+ */
+
+/* Checks if the byte before p is loaded and zero, where p is inside e. */
+static bool zero_before(Range *e, size_t p)
+{
+    return p > e->pos && e->data[p - 1 - e->pos] == 0;
+}
+
+int sb_scan_start_codes_init(SBStartCodeScanner *sc, SBReader *reader, size_t off, size_t len, SBError *err)
+{
+    lock_shared(reader);
+    size_t size = reader->size;
+    unlock(reader);
+
+    if (off > size || len > size - off) {
+        snprintf(err->error, err->size, "Invalid range.");
+        return -1;
     }
 
-    ret = custom_alloc(sizeof(*ret));
-    if (ret == NULL) {
-        snprintf(err->error, err->size, "Could not allocate SBReader.");
-        return NULL;
+    size_t base;
+    reader = root_get(reader, &base);
+    off   += base;
+
+    sc->reader = reader;
+    sc->base   = base;
+    sc->start  = off;
+    sc->pos    = off;
+    sc->end    = off + len;
+    sc->hint   = NULL;
+    sc->gen    = 0;
+
+    return 0;
+}
+
+static int scan_next(SBStartCodeScanner *sc, size_t *code_pos, size_t *nal_pos)
+{
+    static const uint8_t startcode[3] = { 0, 0, 1 };
+    SBReader *reader                  = sc->reader;
+
+    Range *e = hint_get(reader, sc->hint, sc->gen, sc->pos);
+
+    /*
+     * Start codes are only looked for in loaded bytes. Ranges which touch are always
+     * merged, so no start code can span two of them.
+     */
+    for (size_t cur = sc->pos; cur < sc->end;) {
+        Extent ext;
+        e = extent_get(e, cur, sc->end, &ext);
+
+        sc->hint = e;
+        sc->gen  = reader->gen;
+
+        if (ext.data == NULL) {
+            cur = ext.pos + ext.size;
+            continue;
+        }
+
+        const uint8_t *p = find_mem(ext.data, ext.size, &startcode[0], 3);
+        if (p != NULL) {
+            size_t found = ext.pos + (p - ext.data);
+            *nal_pos  = found + 3 - sc->base;
+            *code_pos = (found > sc->start && zero_before(e, found) ? found - 1 : found) - sc->base;
+            sc->pos   = found + 3;
+            return 1;
+        }
+
+        cur = ext.pos + ext.size;
     }
 
-    ret->pos     = 0;
-    ret->size    = size;
-    ret->ranges  = NULL;
-    ret->malloc  = custom_alloc;
-    ret->realloc = custom_realloc;
-    ret->free    = custom_free;
+    sc->pos = sc->end;
+
+    return 0;
+}
+
+int sb_scan_start_codes_next(SBStartCodeScanner *sc, size_t *code_pos, size_t *nal_pos)
+{
+    lock_shared(sc->reader);
+    int ret = scan_next(sc, code_pos, nal_pos);
+    unlock(sc->reader);
 
     return ret;
 }
 
-SBReader *sb_new_reader(size_t size, SBError *err)
+/*
+ * Hashing.
+ */
+
+#define CRC32C_POLY 0x82F63B78
+
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C,
+    0x26A1E7E8, 0xD4CA64EB, 0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+    0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24, 0x105EC76F, 0xE235446C,
+    0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+    0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC,
+    0xBC267848, 0x4E4DFB4B, 0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+    0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35, 0xAA64D611, 0x580F5512,
+    0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+    0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD,
+    0x1642AE59, 0xE4292D5A, 0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+    0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595, 0x417B1DBC, 0xB3109EBF,
+    0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+    0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F,
+    0xED03A29B, 0x1F682198, 0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+    0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38, 0xDBFC821C, 0x2997011F,
+    0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+    0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E,
+    0x4767748A, 0xB50CF789, 0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+    0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46, 0x7198540D, 0x83F3D70E,
+    0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+    0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE,
+    0xDDE0EB2A, 0x2F8B6829, 0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+    0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93, 0x082F63B7, 0xFA44E0B4,
+    0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+    0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B,
+    0xB4091BFF, 0x466298FC, 0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+    0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033, 0xA24BB5A6, 0x502036A5,
+    0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+    0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975,
+    0x0E330A81, 0xFC588982, 0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+    0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622, 0x38CC2A06, 0xCAA7A905,
+    0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+    0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8,
+    0xE52CC12C, 0x1747422F, 0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+    0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0, 0xD3D3E1AB, 0x21B862A8,
+    0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+    0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78,
+    0x7FAB5E8C, 0x8DC0DD8F, 0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+    0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1, 0x69E9F0D5, 0x9B8273D6,
+    0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+    0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69,
+    0xD5CF889D, 0x27A40B9E, 0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+    0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
+};
+
+/* x^(2^n) mod P, for n = 0..31. */
+static const uint32_t crc32c_x2n_table[32] = {
+    0x40000000, 0x20000000, 0x08000000, 0x00800000, 0x00008000, 0x82F63B78,
+    0x6EA2D55C, 0x18B8EA18, 0x510AC59A, 0xB82BE955, 0xB8FDB1E7, 0x88E56F72,
+    0x74C360A4, 0xE4172B16, 0x0D65762A, 0x35D73A62, 0x28461564, 0xBF455269,
+    0xE2EA32DC, 0xFE7740E6, 0xF946610B, 0x3C204F8F, 0x538586E3, 0x59726915,
+    0x734D5309, 0xBC1AC763, 0x7D0722CC, 0xD289CABE, 0xE94CA9BC, 0x05B74F3F,
+    0xA51E1F42, 0x40000000,
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t n)
 {
-    return sb_new_reader_custom_alloc(size, malloc, realloc, free, err);
+    crc = ~crc;
+    while (n--)
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
 }
 
+#if defined(SB_X86_SIMD)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n)
+{
+#if defined(__x86_64__)
+    uint64_t c = ~crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+#else
+    uint32_t c = ~crc;
+    for (; n >= 4; p += 4, n -= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        c = _mm_crc32_u32(c, v);
+    }
+#endif
+    for (; n > 0; p++, n--)
+        c = _mm_crc32_u8((uint32_t) c, *p);
+
+    return ~(uint32_t) c;
+}
+#endif
 
-void sb_free_reader(SBReader **reader)
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t n)
 {
-    SBReader *r = *reader;
+#if defined(SB_X86_SIMD)
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32c_sse42(crc, p, n);
+#endif
 
-    if (r->ranges != NULL)
-        range_free(*reader, &r->ranges);
+    return crc32c_sw(crc, p, n);
+}
 
-    void (*custom_free)(void *ptr) = (*reader)->free;
+/* Multiplies two polynomials modulo the CRC polynomial. */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = UINT32_C(1) << 31;
+    uint32_t p = 0;
 
-    custom_free(*reader);
-    *reader = NULL;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+
+    return p;
 }
 
-void sb_clear(SBReader *reader)
+/* Returns x^(8n) modulo the CRC polynomial, which appends n zero bytes when multiplied in. */
+static uint32_t crc32c_x8nmodp(size_t n)
 {
-    range_free(reader, &reader->ranges);
+    uint32_t xp = UINT32_C(1) << 31;
+
+    for (unsigned int k = 3; n != 0; n >>= 1, k++) {
+        if (n & 1)
+            xp = crc32c_multmodp(crc32c_x2n_table[k & 31], xp);
+    }
+
+    return xp;
 }
 
-size_t sb_bytes_left(SBReader *reader)
+/* Extends a CRC with n zero bytes, in O(log n). */
+static uint32_t crc32c_zeroes(uint32_t crc, size_t n)
 {
-    return reader->size - reader->pos;
+    return ~crc32c_multmodp(crc32c_x8nmodp(n), ~crc);
 }
 
-size_t sb_size(SBReader *reader)
+/* Returns the CRC of A followed by B, given the CRCs of both, and the length of B. */
+static uint32_t crc32c_combine(uint32_t crca, uint32_t crcb, size_t lenb)
 {
-    return reader->size;
+    return crc32c_multmodp(crc32c_x8nmodp(lenb), crca) ^ crcb;
 }
 
-int sb_load_range(SBReader *reader, size_t pos, uint8_t *buf, size_t bufsize, SBError *err)
+static int hash_span(SBReader *reader, size_t off, size_t len, SBHashAlgo algo, uint64_t *hash, SBError *err)
 {
-    if (bufsize == 0) {
-        snprintf(err->error, err->size, "Invalid buffer size.");
+    if (off > reader->size || len > reader->size - off) {
+        snprintf(err->error, err->size, "Invalid range.");
         return -1;
-    } else if (reader->pos + bufsize > reader->size) {
-        snprintf(err->error, err->size, "Cannot load a range passed the end of the sparse buffer size.");
+    } else if (algo != SB_HASH_CRC32C) {
+        snprintf(err->error, err->size, "Invalid hash algorithm.");
         return -1;
     }
 
-    Range *r = reader->malloc(sizeof(*r));
-    if (r == NULL) {
-        snprintf(err->error, err->size, "Could not allocate new range.");
-        return -1;
+    size_t base;
+    reader = root_get(reader, &base);
+    off   += base;
+
+    size_t end   = off + len;
+    uint32_t crc = 0;
+    Range *e     = reader->ranges;
+    for (size_t cur = off; cur < end;) {
+        Extent ext;
+        e   = extent_get(e, cur, end, &ext);
+        cur = ext.pos + ext.size;
+
+        if (ext.data == NULL) {
+            crc = crc32c_zeroes(crc, ext.size);
+        } else if (ext.pos == e->pos && ext.size == e->size) {
+            /*
+             * Whole ranges are hashed once, and combined in afterwards. Concurrent
+             * hashes may both fill in the cache, with the same value.
+             */
+            uint32_t rcrc;
+            if (ATOMIC_LOAD(&e->crc_valid)) {
+                rcrc = ATOMIC_LOAD(&e->crc);
+            } else {
+                rcrc = crc32c_update(0, e->data, e->size);
+                ATOMIC_STORE(&e->crc, rcrc);
+                ATOMIC_STORE(&e->crc_valid, true);
+            }
+            crc = crc32c_combine(crc, rcrc, e->size);
+        } else {
+            crc = crc32c_update(crc, ext.data, ext.size);
+        }
     }
-    r->prev = NULL;
-    r->next = NULL;
-    r->pos  = pos;
-    r->size = bufsize;
-    r->data = reader->malloc(bufsize);
-    if (r->data == NULL) {
-        reader->free(r);
-        snprintf(err->error, err->size, "Could not allocate buffer for spares list entry.");
+
+    *hash = crc;
+
+    return 0;
+}
+
+int sb_hash(SBReader *reader, size_t off, size_t len, SBHashAlgo algo, uint64_t *hash, SBError *err)
+{
+    lock_shared(reader);
+    int ret = hash_span(reader, off, len, algo, hash, err);
+    unlock(reader);
+
+    return ret;
+}
+
+/*
+ * Tuning.
+ */
+
+void sb_set_stream_threshold(SBReader *reader, size_t threshold)
+{
+    size_t base;
+    reader = root_get(reader, &base);
+
+    lock_exclusive(reader);
+    reader->stream_threshold = threshold;
+    unlock(reader);
+}
+
+void sb_set_parallel_copy(SBReader *reader, size_t threshold, size_t workers,
+                          void (*run)(void *pool, void (*task)(void *arg, size_t i), void *arg, size_t n), void *pool)
+{
+    size_t base;
+    reader = root_get(reader, &base);
+
+    if (workers < 1)
+        workers = 1;
+    else if (workers > MAX_PARALLEL_WORKERS)
+        workers = MAX_PARALLEL_WORKERS;
+
+    lock_exclusive(reader);
+    reader->parallel_threshold = threshold;
+    reader->parallel_workers   = workers;
+    reader->parallel_run       = run != NULL ? run : run_threads;
+    if (run == NULL && threshold != 0 && workers > 1)
+        pool_start(reader);
+    reader->parallel_pool = run != NULL ? pool : reader->pool;
+    unlock(reader);
+}
+
+int sb_set_spill(SBReader *reader, const char *dir, size_t limit, SBError *err)
+{
+#if defined(SB_POSIX)
+    if (reader->parent != NULL) {
+        snprintf(err->error, err->size, "Cannot modify a view.");
+        return -1;
+    } else if (reader->read_only) {
+        snprintf(err->error, err->size, "Cannot modify a snapshot.");
+        return -1;
+    } else if (reader->flags & SB_SPARSE_MAP) {
+        snprintf(err->error, err->size, "Cannot spill a sparse mapped reader.");
         return -1;
     }
-    memcpy(r->data, buf, bufsize);
 
-    /* If list is empty, just add the new range and return. */
-    if (reader->ranges == NULL) {
-        reader->ranges = r;
+    SpillFile *sf = NULL;
+    if (dir != NULL) {
+        static const char name[] = "/sbspill-XXXXXX";
+        size_t dlen              = strlen(dir);
+
+        char *path = reader->malloc(dlen + sizeof(name));
+        if (path == NULL) {
+            snprintf(err->error, err->size, "Could not allocate spill file path.");
+            return -1;
+        }
+        memcpy(path, dir, dlen);
+        memcpy(path + dlen, name, sizeof(name));
+
+        /* The file is unlinked straight away, so it goes away with its last user. */
+        int fd      = mkstemp(path);
+        int fderrno = errno;
+        if (fd >= 0)
+            unlink(path);
+        reader->free(path);
+        if (fd < 0) {
+            snprintf(err->error, err->size, "Could not create spill file: %s.", strerror(fderrno));
+            return -1;
+        }
+
+        sf = reader->malloc(sizeof(*sf));
+        if (sf == NULL) {
+            close(fd);
+            snprintf(err->error, err->size, "Could not allocate spill file.");
+            return -1;
+        }
+        if (pthread_mutex_init(&sf->lock, NULL) != 0) {
+            reader->free(sf);
+            close(fd);
+            snprintf(err->error, err->size, "Could not initialize spill file lock.");
+            return -1;
+        }
+        sf->refs   = 1;
+        sf->fd     = fd;
+        sf->end    = 0;
+        sf->holes  = NULL;
+        sf->malloc = reader->malloc;
+        sf->free   = reader->free;
+    }
+
+    lock_exclusive(reader);
+    if (reader->spill != NULL)
+        spill_put(reader->spill);
+    reader->spill       = sf;
+    reader->spill_limit = limit;
+
+    spill(reader);
+    int ret = publish(reader, err);
+    unlock(reader);
+
+    return ret;
+#else
+    (void) reader;
+    (void) dir;
+    (void) limit;
+    snprintf(err->error, err->size, "Spilling is not supported on this platform.");
+    return -1;
+#endif
+}
+
+size_t sb_resident_size(SBReader *reader)
+{
+    size_t base;
+    SBReader *root = root_get(reader, &base);
+
+    lock_shared(reader);
+    size_t ret = 0;
+    for (Range *e = root->ranges; e != NULL; e = e->next) {
+        if (data_resident(root, e->data))
+            ret += e->size;
+    }
+    unlock(reader);
+
+    return ret;
+}
+
+/* A private anonymous mapping on POSIX systems, and a plain allocation elsewhere. */
+struct SBReadBuffer {
+    uint8_t *data;
+    size_t size;
+};
+
+SBReadBuffer *sb_alloc_read_buffer(size_t size, SBError *err)
+{
+    if (size == 0) {
+        snprintf(err->error, err->size, "Invalid buffer size.");
+        return NULL;
+    }
+
+    SBReadBuffer *ret = malloc(sizeof(*ret));
+    if (ret == NULL) {
+        snprintf(err->error, err->size, "Could not allocate read buffer.");
+        return NULL;
+    }
+    ret->size = size;
+
+#if defined(SB_POSIX)
+    ret->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ret->data == MAP_FAILED)
+        ret->data = NULL;
+#else
+    ret->data = malloc(size);
+#endif
+    if (ret->data == NULL) {
+        free(ret);
+        snprintf(err->error, err->size, "Could not allocate read buffer.");
+        return NULL;
+    }
+
+    return ret;
+}
+
+void sb_free_read_buffer(SBReadBuffer **buf)
+{
+#if defined(SB_POSIX)
+    munmap((*buf)->data, (*buf)->size);
+#else
+    free((*buf)->data);
+#endif
+    free(*buf);
+    *buf = NULL;
+}
+
+uint8_t *sb_read_buffer_data(SBReadBuffer *buf)
+{
+    return buf->data;
+}
+
+static size_t read_remap(SBReader *reader, SBReadBuffer *rb, size_t off, size_t size, SBError *err)
+{
+    if (size == 0) {
+        snprintf(err->error, err->size, "Cannot read zero bytes.");
+        return 0;
+    } else if (size > reader->size - reader->win.pos) {
+        snprintf(err->error, err->size, "Cannot read past EOF.");
+        return 0;
+    } else if (off > rb->size || size > rb->size - off) {
+        snprintf(err->error, err->size, "Cannot read past the end of the buffer.");
         return 0;
     }
 
-    /* Merge with an existing range if needed. */
-    bool merged   = false;
-    Range mr      = { 0 };
-    Range *mrange = NULL;
-    for (Range *e = reader->ranges; e != NULL; e = e->next) {
-        int mret = merge(reader, r, e, &mr, &merged);
-        if (mret < 0) {
-            reader->free(r->data);
-            reader->free(r);
-            snprintf(err->error, err->size, "Could not allocate merged buffer.");
-            return -1;
+    size_t base;
+    SBReader *root = root_get(reader, &base);
+    uint8_t *buf   = rb->data + off;
+
+#if defined(SB_POSIX)
+    uintptr_t pagesize = (uintptr_t) sysconf(_SC_PAGESIZE);
+#endif
+
+    size_t start = base + reader->win.pos;
+    size_t end   = start + size;
+    Range *e     = root->ranges;
+    for (size_t cur = start; cur < end;) {
+        Extent ext;
+        e = extent_get(e, cur, end, &ext);
+
+        uint8_t *dst = buf + (cur - start);
+        cur          = ext.pos + ext.size;
+
+        if (ext.data != NULL) {
+            copy_data(root, dst, ext.data, ext.size);
+            continue;
         }
-        if (merged) {
-            e->pos  = mr.pos;
-            e->size = mr.size;
-            reader->free(e->data);
-            e->data = mr.data;
-            mrange  = e;
-            break;
+
+#if defined(SB_POSIX)
+        /*
+         * Give whole pages of the hole back, and only write the edges. The buffer is a
+         * private anonymous mapping, so they read as zeroes from then on.
+         */
+        uintptr_t pstart = ((uintptr_t) dst + pagesize - 1) & ~(pagesize - 1);
+        uintptr_t pend   = ((uintptr_t) dst + ext.size) & ~(pagesize - 1);
+        if (pstart < pend && madvise((void *) pstart, pend - pstart, MADV_DONTNEED) == 0) {
+            zero_fill(root, dst, (uint8_t *) pstart - dst);
+            zero_fill(root, (uint8_t *) pend, dst + ext.size - (uint8_t *) pend);
+            continue;
         }
+#endif
+
+        zero_fill(root, dst, ext.size);
     }
 
-    if (merged) {
-        /* Merge with any further ranges, if necessary. */
-        bool mergeagain = true;
-        while (mergeagain) {
-            mergeagain = false;
-            Range *mrng = mrange;
-            for (Range *e = mrange->next; e != NULL; e = e->next) {
-                bool m;
-                int mret = merge(reader, mrng, e, &mr, &m);
-                if (mret < 0) {
-                    reader->free(r->data);
-                    reader->free(r);
-                    snprintf(err->error, err->size, "Could not allocate merged buffer.");
-                    return -1;
-                }
-                if (m) {
-                    mrange->pos  = mr.pos;
-                    mrange->size = mr.size;
+    window_reset(reader);
+    reader->win.pos += size;
+
+    return size;
+}
+
+size_t sb_read_remap(SBReader *reader, SBReadBuffer *buf, size_t off, size_t size, SBError *err)
+{
+    lock_position(reader);
+    size_t ret = read_remap(reader, buf, off, size, err);
+    unlock_position(reader);
+
+    waiters_wake(reader);
+
+    return ret;
+}
+
+/*
+ * Range iteration.
+ */
+
+int sb_range_iter_init(SBRangeIter *it, SBReader *reader, size_t off, size_t len, SBError *err)
+{
+    lock_shared(reader);
+    size_t size = reader->size;
+    unlock(reader);
+
+    if (off > size || len > size - off) {
+        snprintf(err->error, err->size, "Invalid range.");
+        return -1;
+    }
+
+    size_t base;
+    reader = root_get(reader, &base);
+    off   += base;
+
+    it->reader = reader;
+    it->base   = base;
+    it->pos    = off;
+    it->end    = off + len;
+    it->hint   = NULL;
+    it->gen    = 0;
+
+    return 0;
+}
+
+int sb_range_iter_next(SBRangeIter *it, SBRange *range, const uint8_t **data)
+{
+    if (it->pos >= it->end)
+        return 0;
+
+    lock_shared(it->reader);
+
+    Extent ext;
+    Range *e = hint_get(it->reader, it->hint, it->gen, it->pos);
+    it->hint = extent_get(e, it->pos, it->end, &ext);
+    it->gen  = it->reader->gen;
+    it->pos  = ext.pos + ext.size;
+
+    unlock(it->reader);
+
+    range->pos  = ext.pos - it->base;
+    range->size = ext.size;
+    *data       = ext.data;
+
+    return 1;
+}
+
+/*
+ * Locking.
+ */
+
+void sb_lock_shared(SBReader *reader)
+{
+    lock_shared(reader);
+}
 
-                    reader->free(mrange->data);
-                    mrange->data = mr.data;
+void sb_unlock_shared(SBReader *reader)
+{
+    unlock(reader);
+}
 
-                    range_remove(reader, &reader->ranges, e->pos);
+/*
+ * Cursors.
+ */
 
-                    mergeagain = true;
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        reader->free(r->data);
-        reader->free(r);
-    } else {
-        /* Just insert it as-is. */
-        Range *e;
-        for (e = reader->ranges; e != NULL; e = e->next) {
-            if (r->pos < e->pos)
-                break;
-        }
-        if (e == NULL)
-            range_insert_end(reader->ranges, r);
-        else
-            range_insert_before(&reader->ranges, r, e->pos);
-    }
+int sb_cursor_init(SBCursor *cur, SBReader *reader)
+{
+    cur->reader = reader;
+    cur->pos    = 0;
+    cur->hint   = NULL;
+    cur->gen    = 0;
 
     return 0;
 }
 
-size_t sb_read(SBReader *reader, uint8_t *buf, size_t size, SBError *err)
+static size_t cursor_read(SBCursor *cur, uint8_t *buf, size_t size, SBError *err)
 {
+    SBReader *reader = cur->reader;
+
     if (size == 0) {
         snprintf(err->error, err->size, "Cannot read zero bytes.");
         return 0;
+    } else if (cur->pos > reader->size || size > reader->size - cur->pos) {
+        snprintf(err->error, err->size, "Cannot read past EOF.");
+        return 0;
     }
 
-    size_t off = reader->pos;
-    size_t pos = 0;
-    size_t rem = size;
-    for (Range *e = reader->ranges; e != NULL; e = e->next) {
-        if (e->pos + e->size < off)
-            continue;
-
-        /* Output zeroes until we hit the start of a range. */
-        if (e->pos > off) {
-            size_t zerosize = e->pos - off;
-            if (zerosize > rem)
-                zerosize = rem;
-            memset(buf + pos, 0, zerosize);
-            pos += zerosize;
-            off += zerosize;
-            rem -= zerosize;
-        }
-        if (rem == 0)
-            break;
-
-        size_t copysize = e->size - (off - e->pos);
-        if (copysize > rem)
-            copysize = rem;
-        memcpy(buf + pos, e->data + (off - e->pos), copysize);
-        pos += copysize;
-        off += copysize;
-        rem -= copysize;
-        if (rem == 0)
-            break;
-    }
+    size_t base;
+    SBReader *root = root_get(reader, &base);
 
-    /* Output zeros until we hit the end the requested size. */
-    if (rem > 0 && off < reader->size) {
-        size_t zerosize = reader->size - off;
-        if (zerosize > rem)
-            zerosize = rem;
-        memset(buf + pos, 0, zerosize);
-        pos += zerosize;
-        off += zerosize;
-        rem -= zerosize;
+    size_t off = base + cur->pos;
+    if (root->flags & SB_SPARSE_MAP) {
+        copy_data(root, buf, root->map->base + off, size);
+        cur->pos += size;
+        return size;
     }
 
-    if (rem != 0) {
-        snprintf(err->error, err->size, "Cannot read past EOF.");
-        return 0;
-    }
+    Range *e   = hint_get(root, cur->hint, cur->gen, off);
 
-    reader->pos += size;
+    cur->hint = read_at(root, e, off, buf, size);
+    cur->gen  = root->gen;
+    cur->pos += size;
 
     return size;
 }
 
-int sb_seek(SBReader *reader, size_t offset, SBWhence whence, size_t *pos, SBError *err)
+size_t sb_cursor_read(SBCursor *cur, uint8_t *buf, size_t size, SBError *err)
+{
+    if (cur->reader->flags & SB_LOCK_FREE_READS)
+        return read_lock_free(cur->reader, &cur->pos, buf, size, err);
+
+    lock_shared(cur->reader);
+    size_t ret = cursor_read(cur, buf, size, err);
+    unlock(cur->reader);
+
+    return ret;
+}
+
+int sb_cursor_seek(SBCursor *cur, size_t offset, SBWhence whence, size_t *pos, SBError *err)
 {
     size_t realoffset;
 
+    lock_shared(cur->reader);
+    size_t size = cur->reader->size;
+    unlock(cur->reader);
+
     switch (whence) {
     case SB_SET:
         realoffset = offset;
         break;
     case SB_CUR:
-        realoffset = offset + reader->pos;
+        realoffset = offset + cur->pos;
         break;
     case SB_END:
-        if (offset > reader->size) {
+        if (offset > size) {
             snprintf(err->error, err->size, "Cannot seek past beginning of file.");
             return -1;
         }
-        realoffset = reader->size - offset;
+        realoffset = size - offset;
         break;
     default:
         snprintf(err->error, err->size, "Invalid whence.");
         return -1;
     }
 
-    if (realoffset > reader->size) {
+    if (realoffset > size) {
         snprintf(err->error, err->size, "Cannot seek past end of file.");
         return -1;
     }
 
-    reader->pos = realoffset;
-    *pos        = realoffset;
+    cur->pos = realoffset;
+    *pos     = realoffset;
 
     return 0;
 }
 
-int sb_remove_range(SBReader *reader, size_t start, size_t end, SBError *err)
+size_t sb_cursor_tell(SBCursor *cur)
 {
-    if (end >= reader->size || end < start) {
+    return cur->pos;
+}
+
+/*
+ * Notifications.
+ */
+
+int sb_notify_add(SBReader *reader, size_t off, size_t len, void (*func)(void *opaque), void *opaque, SBError *err)
+{
+    lock_shared(reader);
+    size_t size = reader->size;
+    unlock(reader);
+
+    if (len == 0 || off > size || len > size - off) {
         snprintf(err->error, err->size, "Invalid range.");
         return -1;
     }
 
-    for (Range *e = reader->ranges; e != NULL;) {
-        size_t rngstart = e->pos;
-        size_t rngend   = e->pos + e->size - 1;
+    size_t base;
+    SBReader *root = root_get(reader, &base);
 
-        /* Current range is after the deletion range. */
-        if (rngstart > end)
-            break;
+    Notify *n = root->malloc(sizeof(*n));
+    if (n == NULL) {
+        snprintf(err->error, err->size, "Could not allocate notification.");
+        return -1;
+    }
+    n->prev   = NULL;
+    n->start  = base + off;
+    n->end    = base + off + len;
+    n->func   = func;
+    n->opaque = opaque;
 
-        /* Current range is before the deletion range. */
-        if (rngend < start) {
-            e = e->next;
-            continue;
+    /* Register before checking, so a load after the check always sees it. */
+    notify_lock(root);
+    n->next = root->notifies;
+    if (n->next != NULL)
+        n->next->prev = n;
+    ATOMIC_STORE(&root->notifies, n);
+
+    lock_shared(root);
+    bool loaded = span_loaded(root, n->start, n->end);
+    unlock(root);
+
+    if (loaded)
+        notify_unlink(root, n);
+    notify_unlock(root);
+
+    if (loaded) {
+        root->free(n);
+        return 1;
+    }
+
+    return 0;
+}
+
+void sb_notify_cancel(SBReader *reader, void *opaque)
+{
+    size_t base;
+    reader = root_get(reader, &base);
+
+    notify_lock(reader);
+
+    for (Notify *n = reader->notifies, *next; n != NULL; n = next) {
+        next = n->next;
+        if (n->opaque == opaque) {
+            notify_unlink(reader, n);
+            reader->free(n);
         }
+    }
 
-        /* Current range is entirely in the deletion range. */
-        if (rngstart >= start && rngend <= end) {
-            Range *next = e->next;
-            range_remove(reader, &reader->ranges, e->pos);
-            e = next;
+    Notify *prev = NULL;
+    for (Notify *n = reader->ready, *next; n != NULL; n = next) {
+        next = n->next;
+        if (n->opaque != opaque) {
+            prev = n;
             continue;
         }
+        if (prev != NULL)
+            prev->next = next;
+        else
+            reader->ready = next;
+        if (reader->ready_tail == n)
+            reader->ready_tail = prev;
+        reader->free(n);
+    }
+    if (reader->ready == NULL)
+        event_fd_drain(reader);
 
-        /* We need to split an existing range, since we're in between it. */
-        if (rngend > end && rngstart < start) {
-            Range *rng0 = reader->malloc(sizeof(Range));
-            if (rng0 == NULL) {
-                snprintf(err->error, err->size, "Could not allocate new range buffer.");
-                return -1;
-            }
+    notify_unlock(reader);
+}
 
-            rng0->pos  = end + 1;
-            rng0->size = rngend + 1 - rng0->pos;
-            rng0->data = reader->malloc(rng0->size);
-            if (rng0->data == NULL) {
-                reader->free(rng0);
-                snprintf(err->error, err->size, "Could not allocate new range data.");
-                return -1;
-            }
-            memcpy(rng0->data, e->data + end + 1 - rngstart, rng0->size);
+int sb_notify_next(SBReader *reader, void **opaque)
+{
+    size_t base;
+    reader = root_get(reader, &base);
 
-            range_insert_after(reader->ranges, rng0, e->pos);
+    notify_lock(reader);
 
-            e->size      = start - e->pos;
-            uint8_t *tmp = reader->realloc(e->data, e->size);
-            if (tmp == NULL) {
-                snprintf(err->error, err->size, "Could not realloc split range data.");
-                return -1;
-            }
-            e->data = tmp;
+    Notify *n = reader->ready;
+    if (n != NULL) {
+        reader->ready = n->next;
+        if (reader->ready == NULL) {
+            reader->ready_tail = NULL;
+            event_fd_drain(reader);
+        }
+    }
 
-            e = rng0->next;
+    notify_unlock(reader);
 
-            continue;
-        }
+    if (n == NULL)
+        return 0;
 
-        /* Current range overlaps the start of the deletion range. */
-        if (rngstart < start) {
-            e->size      = start - e->pos;
-            uint8_t *tmp = reader->realloc(e->data, e->size);
-            if (tmp == NULL) {
-                snprintf(err->error, err->size, "Could not realloc reduced range data.");
-                return -1;
+    *opaque = n->opaque;
+    reader->free(n);
+
+    return 1;
+}
+
+int sb_notify_fd(SBReader *reader, SBError *err)
+{
+#if defined(SB_POSIX)
+    size_t base;
+    reader = root_get(reader, &base);
+
+    notify_lock(reader);
+
+    if (reader->event_fd < 0) {
+#if defined(__linux__)
+        reader->event_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        reader->event_wfd = reader->event_fd;
+#else
+        int fds[2];
+        if (pipe(fds) == 0) {
+            for (int i = 0; i < 2; i++) {
+                fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+                fcntl(fds[i], F_SETFD, FD_CLOEXEC);
             }
-            e->data = tmp;
+            reader->event_fd  = fds[0];
+            reader->event_wfd = fds[1];
         }
+#endif
+        if (reader->event_fd >= 0 && reader->ready != NULL)
+            event_fd_signal(reader);
+    }
+    int ret = reader->event_fd;
 
-        /* current range overlaps the end of the deletion range. */
-        if (rngend > end) {
-            size_t oldSize = e->size;
-            e->size -= end + 1 - e->pos;
-            e->pos   = end + 1;
+    notify_unlock(reader);
 
-            uint8_t *newdata = reader->malloc(e->size);
-            if (newdata == NULL) {
-                snprintf(err->error, err->size, "Could not allocate new range data.");
-                return 1;
-            }
-            memcpy(newdata, e->data + oldSize - e->size, e->size);
+    if (ret < 0)
+        snprintf(err->error, err->size, "Could not create event fd.");
+
+    return ret;
+#else
+    (void) reader;
+    snprintf(err->error, err->size, "Event fds are not supported on this platform.");
+    return -1;
+#endif
+}
+
+/*
+ * Sharded readers. Each shard is a thread-safe reader of its own. Operations
+ * spanning several shards lock all of them, in order, so they cannot deadlock,
+ * and are seen whole by other operations.
+ */
+
+SBShardedReader *sb_new_sharded_reader(size_t size, size_t count, void *(*custom_alloc)(size_t size),
+                                       void *(*custom_realloc)(void *ptr, size_t size), void (*custom_free)(void *ptr),
+                                       SBError *err)
+{
+    SBShardedReader *ret;
+
+    if (size == 0) {
+        snprintf(err->error, err->size, "Invalid reader size.");
+        return NULL;
+    } else if (count == 0 || count > size) {
+        snprintf(err->error, err->size, "Invalid shard count.");
+        return NULL;
+    }
+
+    if (custom_alloc == NULL) {
+        custom_alloc   = malloc;
+        custom_realloc = realloc;
+        custom_free    = free;
+    }
+
+    ret = custom_alloc(sizeof(*ret));
+    if (ret == NULL) {
+        snprintf(err->error, err->size, "Could not allocate SBShardedReader.");
+        return NULL;
+    }
+
+    /* Rounding the shard size up may leave fewer shards than asked for. */
+    ret->size       = size;
+    ret->shard_size = size / count + (size % count != 0);
+    ret->count      = (size + ret->shard_size - 1) / ret->shard_size;
+    ret->free       = custom_free;
 
-            reader->free(e->data);
+    ret->shards = custom_alloc(ret->count * sizeof(*ret->shards));
+    if (ret->shards == NULL) {
+        custom_free(ret);
+        snprintf(err->error, err->size, "Could not allocate shards.");
+        return NULL;
+    }
 
-            e->data = newdata;
+    for (size_t i = 0; i < ret->count; i++) {
+        size_t start = i * ret->shard_size;
+        size_t len   = size - start < ret->shard_size ? size - start : ret->shard_size;
+
+        ret->shards[i] = sb_new_reader_flags(len, SB_THREAD_SAFE, custom_alloc, custom_realloc, custom_free, err);
+        if (ret->shards[i] == NULL) {
+            while (i-- > 0)
+                sb_free_reader(&ret->shards[i]);
+            custom_free(ret->shards);
+            custom_free(ret);
+            return NULL;
         }
+    }
 
-        e = e->next;
+    return ret;
+}
+
+void sb_free_sharded_reader(SBShardedReader **reader)
+{
+    SBShardedReader *r = *reader;
+
+    for (size_t i = 0; i < r->count; i++)
+        sb_free_reader(&r->shards[i]);
+
+    r->free(r->shards);
+    r->free(r);
+    *reader = NULL;
+}
+
+/* Locks the shards covering [pos, end), returning the first, and the one after the last. */
+static size_t shards_lock(SBShardedReader *reader, size_t pos, size_t end, bool exclusive, size_t *last)
+{
+    size_t first = pos / reader->shard_size;
+    *last        = (end - 1) / reader->shard_size + 1;
+
+    for (size_t i = first; i < *last; i++) {
+        if (exclusive)
+            lock_exclusive(reader->shards[i]);
+        else
+            lock_shared(reader->shards[i]);
     }
 
-    return 0;
+    return first;
 }
 
-int sb_resize(SBReader *reader, size_t newsize, SBError *err)
+static void shards_unlock(SBShardedReader *reader, size_t first, size_t last)
 {
-    if (newsize == 0) {
-        snprintf(err->error, err->size, "Cannot resize to zero size.");
+    for (size_t i = first; i < last; i++)
+        unlock(reader->shards[i]);
+}
+
+/* Gets the part of [pos, end) in a shard, relative to the shard. */
+static void shard_part(SBShardedReader *reader, size_t i, size_t pos, size_t end, size_t *start, size_t *stop)
+{
+    size_t base = i * reader->shard_size;
+
+    *start = (pos > base ? pos : base) - base;
+    *stop  = (end < base + reader->shard_size ? end : base + reader->shard_size) - base;
+}
+
+/* Adds which shard failed to the error, and that the shards before it were changed. */
+static void shard_error(SBShardedReader *reader, size_t i, size_t first, SBError *err)
+{
+    if (err->size == 0)
+        return;
+
+    size_t len = strlen(err->error);
+    if (len + 1 >= err->size)
+        return;
+
+    if (i > first + 1)
+        snprintf(err->error + len, err->size - len, " (shard %zu, at %zu; shards %zu to %zu were changed)", i,
+                 i * reader->shard_size, first, i - 1);
+    else if (i > first)
+        snprintf(err->error + len, err->size - len, " (shard %zu, at %zu; shard %zu was changed)", i,
+                 i * reader->shard_size, first);
+    else
+        snprintf(err->error + len, err->size - len, " (shard %zu, at %zu)", i, i * reader->shard_size);
+}
+
+int sb_sharded_load_range(SBShardedReader *reader, size_t pos, uint8_t *buf, size_t bufsize, SBError *err)
+{
+    if (bufsize == 0) {
+        snprintf(err->error, err->size, "Invalid buffer size.");
+        return -1;
+    } else if (pos > reader->size || bufsize > reader->size - pos) {
+        snprintf(err->error, err->size, "Cannot load a range passed the end of the sparse buffer size.");
         return -1;
     }
 
-    if (newsize < reader->size) {
-        int ret = sb_remove_range(reader, newsize, reader->size - 1, err);
+    size_t last;
+    size_t first = shards_lock(reader, pos, pos + bufsize, true, &last);
+
+    int ret = 0;
+    for (size_t i = first; i < last && ret == 0; i++) {
+        size_t start, stop;
+        shard_part(reader, i, pos, pos + bufsize, &start, &stop);
+        ret = load_range(reader->shards[i], start, buf + (i * reader->shard_size + start - pos), stop - start, err);
         if (ret < 0)
-            return ret;
-        if (reader->pos > newsize)
-            reader->pos = newsize;
+            shard_error(reader, i, first, err);
     }
 
-    reader->size = newsize;
+    shards_unlock(reader, first, last);
+
+    return ret;
+}
+
+int sb_sharded_remove_range(SBShardedReader *reader, size_t start, size_t end, SBError *err)
+{
+    if (end >= reader->size || end < start) {
+        snprintf(err->error, err->size, "Invalid range.");
+        return -1;
+    }
+
+    size_t last;
+    size_t first = shards_lock(reader, start, end + 1, true, &last);
+
+    int ret = 0;
+    for (size_t i = first; i < last && ret == 0; i++) {
+        size_t pstart, pstop;
+        shard_part(reader, i, start, end + 1, &pstart, &pstop);
+        ret = remove_range(reader->shards[i], pstart, pstop - 1, err);
+        if (ret < 0)
+            shard_error(reader, i, first, err);
+    }
+
+    shards_unlock(reader, first, last);
+
+    return ret;
+}
+
+size_t sb_sharded_read(SBShardedReader *reader, size_t pos, uint8_t *buf, size_t size, SBError *err)
+{
+    if (size == 0) {
+        snprintf(err->error, err->size, "Cannot read zero bytes.");
+        return 0;
+    } else if (pos > reader->size || size > reader->size - pos) {
+        snprintf(err->error, err->size, "Cannot read past EOF.");
+        return 0;
+    }
+
+    size_t last;
+    size_t first = shards_lock(reader, pos, pos + size, false, &last);
+
+    for (size_t i = first; i < last; i++) {
+        SBReader *shard = reader->shards[i];
+        size_t start, stop;
+        shard_part(reader, i, pos, pos + size, &start, &stop);
+        read_at(shard, shard->ranges, start, buf + (i * reader->shard_size + start - pos), stop - start);
+    }
+
+    shards_unlock(reader, first, last);
+
+    return size;
+}
+
+int sb_sharded_missing_ranges(SBShardedReader *reader, size_t off, size_t len, SBRange *out, size_t max,
+                              size_t gap_merge_threshold, size_t *count, SBError *err)
+{
+    if (len == 0 || off > reader->size || len > reader->size - off) {
+        snprintf(err->error, err->size, "Invalid range.");
+        return -1;
+    }
+
+    size_t last;
+    size_t first = shards_lock(reader, off, off + len, false, &last);
+
+    size_t nb    = 0;
+    bool pending = false;
+    SBRange hole = { 0 };
+    for (size_t i = first; i < last; i++) {
+        size_t base = i * reader->shard_size;
+        size_t cur, end;
+        shard_part(reader, i, off, off + len, &cur, &end);
+
+        for (Range *e = reader->shards[i]->ranges; e != NULL && cur < end; e = e->next) {
+            if (e->pos + e->size <= cur)
+                continue;
+            if (e->pos >= end)
+                break;
+
+            if (e->pos > cur)
+                hole_add(&hole, &pending, base + cur, base + e->pos, gap_merge_threshold, out, max, &nb);
+
+            cur = e->pos + e->size;
+        }
+
+        if (cur < end)
+            hole_add(&hole, &pending, base + cur, base + end, gap_merge_threshold, out, max, &nb);
+    }
+
+    shards_unlock(reader, first, last);
+
+    if (pending) {
+        if (nb < max)
+            out[nb] = hole;
+        nb++;
+    }
+
+    *count = nb;
 
     return 0;
 }
@@ -20,8 +20,22 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-/* Opaque type for the API. */
+/* Opaque types for the API. */
 typedef struct SBReader SBReader;
+typedef struct SBShardedReader SBShardedReader;
+
+/*
+ * The current position of a reader, and the loaded bytes directly at it. See: sb_window().
+ *
+ * Bytes from cur up to end are loaded, and are those at pos onwards. Reading n of
+ * them advances cur and pos by n together. When nothing is loaded at pos, or the
+ * reader is thread-safe, cur and end are both NULL, or equal.
+ */
+typedef struct SBWindow {
+    size_t pos;         /* The current position of the reader. */
+    const uint8_t *cur; /* The loaded data at pos. */
+    const uint8_t *end; /* The end of the loaded data at pos. */
+} SBWindow;
 
 /* User supplied error buffer. */
 typedef struct SBError {
@@ -36,6 +50,106 @@ typedef enum SBWhence {
     SB_END = 2
 } SBWhence;
 
+/* Flags for sb_new_reader_flags(). */
+typedef enum SBReaderFlags {
+    SB_THREAD_SAFE     = 1 << 0,
+    SB_LOCK_FREE_READS = 1 << 1,
+    SB_SPARSE_MAP      = 1 << 2
+} SBReaderFlags;
+
+/* Hash algorithms for sb_hash(). */
+typedef enum SBHashAlgo {
+    SB_HASH_CRC32C = 0
+} SBHashAlgo;
+
+/* A span of bytes in the sparse buffer. */
+typedef struct SBRange {
+    size_t pos;
+    size_t size;
+} SBRange;
+
+/* A buffer for sb_read_remap(), allocated by sb_alloc_read_buffer(). */
+typedef struct SBReadBuffer SBReadBuffer;
+
+/* A single read request for sb_read_batch(). */
+typedef struct SBReadReq {
+    size_t pos;
+    size_t size;
+    uint8_t *buf;
+} SBReadReq;
+
+/* A single range to load from a file with sb_load_batch(). */
+typedef struct SBLoadJob {
+    size_t pos;
+    int fd;
+    uint64_t file_off;
+    size_t len;
+} SBLoadJob;
+
+/* How sb_load_batch() reads files. */
+typedef enum SBLoadMethod {
+    SB_LOAD_ANY      = 0, /* io_uring if available, otherwise pread(). */
+    SB_LOAD_PREAD    = 1,
+    SB_LOAD_IO_URING = 2  /* Fails if io_uring is unavailable. */
+} SBLoadMethod;
+
+/*
+ * Bitstream reader over a span of a sparse buffer reader. May be allocated
+ * by the user, but must be initialized with sb_bitreader_init(), and its
+ * fields must not be used directly.
+ */
+typedef struct SBBitReader {
+    SBReader *reader;
+    size_t start;
+    size_t pos;
+    size_t end;
+    uint64_t cache;
+    unsigned int bits;
+    void *hint;
+    uint64_t gen;
+} SBBitReader;
+
+/*
+ * Annex B start code scanner over a span of a sparse buffer reader. May be
+ * allocated by the user, but must be initialized with sb_scan_start_codes_init(),
+ * and its fields must not be used directly.
+ */
+typedef struct SBStartCodeScanner {
+    SBReader *reader;
+    size_t base;
+    size_t start;
+    size_t pos;
+    size_t end;
+    void *hint;
+    uint64_t gen;
+} SBStartCodeScanner;
+
+/*
+ * Independent read position over a sparse buffer reader. May be allocated by
+ * the user, but must be initialized with sb_cursor_init(), and its fields must
+ * not be used directly.
+ */
+typedef struct SBCursor {
+    SBReader *reader;
+    size_t pos;
+    void *hint;
+    uint64_t gen;
+} SBCursor;
+
+/*
+ * Iterator over the loaded and unloaded extents of a span of a sparse buffer
+ * reader. May be allocated by the user, but must be initialized with
+ * sb_range_iter_init(), and its fields must not be used directly.
+ */
+typedef struct SBRangeIter {
+    SBReader *reader;
+    size_t base;
+    size_t pos;
+    size_t end;
+    void *hint;
+    uint64_t gen;
+} SBRangeIter;
+
 /*
  * Creates a new sparse buffer reader with default allocators.
  *
@@ -66,6 +180,111 @@ SBReader *sb_new_reader(size_t size, SBError *err);
 SBReader *sb_new_reader_custom_alloc(size_t size, void *(*custom_alloc)(size_t size),
                                      void *(*custom_realloc)(void *ptr, size_t size), void (*custom_free)(void *ptr), SBError *err);
 
+/*
+ * Creates a new sparse buffer reader with flags, and optionally user-provided allocators.
+ *
+ * With SB_THREAD_SAFE, ranges may be loaded into and removed from the reader by one
+ * thread while others read from it. Loading, removing, resizing and clearing take an
+ * exclusive lock, and reading takes a shared lock. Reads and seeks on the reader
+ * itself all move its one position, so they run one at a time, but alongside reads
+ * through views and cursors. Each view must only be used by one thread at a time,
+ * so each reading thread should use its own view or cursor to read in parallel. The inline readers
+ * always take the sb_read() path for thread-safe readers.
+ *
+ * SB_LOCK_FREE_READS implies SB_THREAD_SAFE, and additionally lets sb_read() on
+ * views, sb_cursor_read() and sb_read_batch() run without taking any lock, so that
+ * they scale with the number of reading threads. In exchange, each load, removal,
+ * resize or clear copies the range list, and waits for reads already running to
+ * finish, before returning. Range data freed by them is kept until then, and
+ * data shrunk by removals is not reallocated. Other functions still take the
+ * shared lock.
+ *
+ * SB_SPARSE_MAP keeps all loaded data at its own offset in one anonymous mapping of
+ * the whole reader, reserved without committing memory or swap, instead of giving
+ * each range its own buffer. Unloaded holes read as the kernel's zero page, and
+ * memory is only used for pages which have been loaded into. sb_read() and
+ * sb_cursor_read() are then a single copy, with no walk of the ranges, and merging
+ * ranges copies nothing. Removing ranges gives their whole pages back to the kernel.
+ * Only supported on POSIX systems, and cannot be combined with SB_LOCK_FREE_READS,
+ * sb_snapshot(), sb_clone_reader(), or sb_map_file().
+ *
+ * Arguments:
+ *   * size           - The size of the sparse buffer for the reader.
+ *   * flags          - A combination of SBReaderFlags.
+ *   * custom_alloc   - User provided allocation function, which must have the same semantics as malloc,
+ *                      or NULL to use the default allocators.
+ *   * custom_realloc - User provided reallocation function, which must have the same semantics as realloc.
+ *   * custom_free    - User provided free functon, which must have the same semntics as free.
+ *   * err            - A user supplied error buffer.
+ *
+ * Returns:
+ *   A new sparse buffer reader, which must be freed with sb_free_reader()
+ *   after use, or NULL on error.
+ */
+SBReader *sb_new_reader_flags(size_t size, int flags, void *(*custom_alloc)(size_t size),
+                              void *(*custom_realloc)(void *ptr, size_t size), void (*custom_free)(void *ptr), SBError *err);
+
+/*
+ * Creates a view of a window of an existing sparse buffer reader.
+ *
+ * A view is a sparse buffer reader whose position 0 is at offset in its parent,
+ * and whose size is length. It shares its parent's loaded ranges without copying
+ * them, and has its own position. Views are read-only, and are not resized along
+ * with their parent. Views of views are views of the original reader.
+ *
+ * Arguments:
+ *   * parent - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ *   * offset - The position in the parent at which the view starts.
+ *   * length - The size of the view.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   A new view, which must be freed with sb_free_reader() before its parent
+ *   is, or NULL on error.
+ */
+SBReader *sb_new_view(SBReader *parent, size_t offset, size_t length, SBError *err);
+
+/*
+ * Takes a read-only snapshot of the ranges of a sparse buffer reader.
+ *
+ * The snapshot shares the reader's ranges and their data, in O(1), and later
+ * loads, removals, resizes and clears of the reader do not affect it. The
+ * reader copies its list of ranges, but not their data, the first time it
+ * changes it while shared. Loading into, removing from, or resizing the
+ * snapshot fails, and clearing it does nothing. Views of it may be made, and
+ * it is thread-safe if the reader is.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a snapshot. Views cannot be snapshotted.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   A new sparse buffer reader, which must be freed with sb_free_reader()
+ *   after use, or NULL on error. It may outlive the reader.
+ */
+SBReader *sb_snapshot(SBReader *reader, SBError *err);
+
+/*
+ * Clones a sparse buffer reader.
+ *
+ * The clone has the same size, flags and ranges as the reader, but may be changed
+ * independently of it. As with sb_snapshot(), the ranges and their data are shared,
+ * so this costs O(1), or O(ranges) for readers with SB_LOCK_FREE_READS, and each of
+ * the two copies its list of ranges, but not their data, when it first changes it.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a snapshot or clone. Views cannot be cloned.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   A new sparse buffer reader, which must be freed with sb_free_reader()
+ *   after use, or NULL on error.
+ */
+SBReader *sb_clone_reader(SBReader *reader, SBError *err);
+
 /*
  * Frees a sparse buffer reader and sets it to NULL;
  *
@@ -76,7 +295,7 @@ SBReader *sb_new_reader_custom_alloc(size_t size, void *(*custom_alloc)(size_t s
 void sb_free_reader(SBReader **reader);
 
 /*
- * Clears all loaded buffers in a sparse buffer reader.
+ * Clears all loaded buffers in a sparse buffer reader. Does nothing for views.
  *
  * Arguments:
  *   * reader - A pointer to a sparse buffer reader pointer allocated by
@@ -138,6 +357,102 @@ size_t sb_size(SBReader *reader);
  */
 int sb_load_range(SBReader *reader, size_t pos, uint8_t *buf, size_t bufsize, SBError *err);
 
+/*
+ * Loads a range into the sparse buffer straight from a file.
+ *
+ * The file is read with pread() into the range's own storage, rather than through a
+ * temporary buffer which is then copied, and the file offset of fd is left unchanged.
+ * A range loaded directly after an existing one is read onto the end of it when
+ * possible, except for thread-safe readers, which read the file without holding
+ * their lock, and then add the range as sb_load_range() does.
+ *
+ * Only supported on POSIX systems.
+ *
+ * Arguments:
+ *   * reader   - A pointer to a sparse buffer reader pointer allocated by
+ *                sb_new_reader().
+ *   * pos      - The byte position to load the range into, in the sparse buffer.
+ *   * fd       - The file descriptor to read from.
+ *   * file_off - The offset in the file to read from.
+ *   * len      - The number of bytes to load.
+ *   * err      - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error, including if the file ends before len bytes
+ *   have been read. Nothing is loaded on error.
+ */
+int sb_load_from_fd(SBReader *reader, size_t pos, int fd, uint64_t file_off, size_t len, SBError *err);
+
+/*
+ * Loads many ranges into the sparse buffer from files, as one batch.
+ *
+ * Every job is read into its range's own storage, as sb_load_from_fd() does.
+ * On Linux, the reads are submitted together through io_uring, rather than
+ * being made one syscall at a time, and pread() is used where io_uring is not
+ * available. All files are read before the ranges are added, which, for
+ * thread-safe readers, is done under a single hold of the lock. If io_uring
+ * fails part way, reads already submitted are waited for, for a few seconds at
+ * most, and the buffers of any still not complete are leaked.
+ *
+ * Only supported on POSIX systems.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * jobs   - The ranges to load, and where to read each from.
+ *   * n      - The number of jobs.
+ *   * method - How to read the files. See: SBLoadMethod.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error. Nothing is loaded if any read fails, or any
+ *   job is invalid, but earlier jobs may have been loaded if memory runs out.
+ */
+int sb_load_batch(SBReader *reader, const SBLoadJob *jobs, size_t n, SBLoadMethod method, SBError *err);
+
+/*
+ * Maps a file read-only, for ranges to be loaded from with sb_load_mapped().
+ *
+ * Only one file may be mapped per reader, and it stays mapped until the reader,
+ * and any snapshots or clones made of it after this, which share it, are freed.
+ * The whole file is mapped, at its current size. It must not be truncated while
+ * mapped, since reading a mapped range past its new end would then crash.
+ *
+ * Only supported on POSIX systems.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * fd     - The file descriptor of the file to map. It may be closed afterwards.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_map_file(SBReader *reader, int fd, SBError *err);
+
+/*
+ * Loads a range into the sparse buffer from the file mapped with sb_map_file().
+ *
+ * The range points into the mapping rather than holding a copy of the data, so
+ * reads come straight from the page cache, and loaded ranges take no heap memory.
+ * A range which continues a mapped range, both in the sparse buffer and in the file,
+ * is joined with it. Ranges which only partly overlap others are merged into a copy,
+ * as with sb_load_range().
+ *
+ * Arguments:
+ *   * reader  - A pointer to a sparse buffer reader pointer allocated by
+ *               sb_new_reader().
+ *   * pos     - The byte position to load the range into, in the sparse buffer.
+ *   * map_off - The offset of the range in the mapped file.
+ *   * len     - The number of bytes to load.
+ *   * err     - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_load_mapped(SBReader *reader, size_t pos, size_t map_off, size_t len, SBError *err);
+
 /*
  * Remove a range from the sparse buffer.
  *
@@ -170,6 +485,198 @@ int sb_remove_range(SBReader *reader, size_t start, size_t end, SBError *err);
  */
 size_t sb_read(SBReader *reader, uint8_t *buf, size_t size, SBError *err);
 
+/*
+ * Read bytes at the current position of the sparsebuffer, once they are loaded.
+ *
+ * This is the same as sb_read(), except that it first blocks until all of the
+ * requested bytes have been loaded by another thread, or the timeout passes.
+ * Loading a range only wakes the threads whose requested bytes it completes.
+ * If another thread moves the position of the reader meanwhile, the bytes at
+ * the new position are waited for and read instead.
+ *
+ * Arguments:
+ *   * reader     - A pointer to a sparse buffer reader pointer allocated by
+ *                  sb_new_reader_flags() with SB_THREAD_SAFE, or a view of one.
+ *   * buf        - A user supplied buffer to read into.
+ *   * size       - The number of bytes to read.
+ *   * timeout_ms - The maximum number of milliseconds to wait, or < 0 to wait
+ *                  indefinitely.
+ *   * err        - A user supplied error buffer.
+ *
+ * Returns:
+ *   size on success, != size on error, or if the timeout passed first.
+ */
+size_t sb_read_wait(SBReader *reader, uint8_t *buf, size_t size, int timeout_ms, SBError *err);
+
+/*
+ * Reads a batch of spans from the sparse buffer.
+ *
+ * All requests are satisfied in a single pass over the loaded ranges. Requests
+ * which are not already sorted by position are sorted internally first. The
+ * current position of the reader is not used or changed.
+ *
+ * Zeroes will be returned for any ranges not loaded into the sparse buffer.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * reqs   - The read requests. Each request's buf must hold at least
+ *              size bytes.
+ *   * n      - The number of read requests.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error. On error, no request has been read.
+ */
+int sb_read_batch(SBReader *reader, const SBReadReq *reqs, size_t n, SBError *err);
+
+/*
+ * Allocates a buffer for sb_read_remap().
+ *
+ * On POSIX systems the buffer is its own private anonymous memory mapping, so
+ * that whole pages of it can be given back to the OS, to read as zeroes.
+ *
+ * Arguments:
+ *   * size - The size of the buffer in bytes.
+ *   * err  - A user supplied error buffer.
+ *
+ * Returns:
+ *   A new read buffer, which must be freed with sb_free_read_buffer() after use,
+ *   or NULL on error.
+ */
+SBReadBuffer *sb_alloc_read_buffer(size_t size, SBError *err);
+
+/*
+ * Frees a buffer allocated by sb_alloc_read_buffer().
+ *
+ * Arguments:
+ *   * buf - A pointer to a read buffer pointer, which is set to NULL.
+ */
+void sb_free_read_buffer(SBReadBuffer **buf);
+
+/*
+ * Gets the memory of a buffer allocated by sb_alloc_read_buffer().
+ *
+ * Arguments:
+ *   * buf - A read buffer allocated by sb_alloc_read_buffer().
+ *
+ * Returns:
+ *   A pointer to the start of the buffer's memory.
+ */
+uint8_t *sb_read_buffer_data(SBReadBuffer *buf);
+
+/*
+ * Reads bytes at the current position of the sparsebuffer, remapping holes.
+ *
+ * This is the same as sb_read(), reading into the buffer's memory at off, except
+ * that whole pages of it which fall in ranges not loaded into the sparse buffer
+ * are given back to the OS, and read as zeroes afterwards, instead of being
+ * written. Where this is not supported, or fails, they are written as with
+ * sb_read().
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * buf    - A read buffer allocated by sb_alloc_read_buffer().
+ *   * off    - The offset in the buffer to read into.
+ *   * size   - The number of bytes to read.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   size on success, != size on error.
+ */
+size_t sb_read_remap(SBReader *reader, SBReadBuffer *buf, size_t off, size_t size, SBError *err);
+
+/*
+ * Sets the size at which the sparse buffer reader bypasses the CPU cache.
+ *
+ * Copies into and out of the sparse buffer, and zero fills of holes, of at
+ * least this size use non-temporal stores, with the widest vectors the CPU
+ * supports, so that large reads and loads do not evict the rest of the
+ * working set. Defaults to 1 MiB. The threshold is shared with all views
+ * of the reader, including ones that already exist.
+ *
+ * Arguments:
+ *   * reader    - A pointer to a sparse buffer reader pointer allocated by
+ *                 sb_new_reader(), or a view of one.
+ *   * threshold - The size in bytes, or 0 to never bypass the cache.
+ */
+void sb_set_stream_threshold(SBReader *reader, size_t threshold);
+
+/*
+ * Sets up copies into and out of the sparse buffer to be split across workers.
+ *
+ * Copies of at least threshold bytes, by reads, loads and merges, are split into
+ * up to workers pieces, which are run in parallel, so that a single large copy
+ * is not limited to the memory bandwidth of one core. By default, this is off.
+ *
+ * Arguments:
+ *   * reader    - A pointer to a sparse buffer reader pointer allocated by
+ *                 sb_new_reader(), or a view of it, in which case its root is set up.
+ *   * threshold - The size in bytes, or 0 to never split copies.
+ *   * workers   - The number of pieces to split copies into, at most 256.
+ *   * run       - A user provided function, which must call task(arg, i) once for each
+ *                 i in [0, n), and return only once all have returned, such as by queueing
+ *                 them on a thread pool, or NULL to run them on threads kept by the
+ *                 reader, which are started here and stopped by sb_free_reader().
+ *   * pool      - A user supplied pointer passed to run.
+ */
+void sb_set_parallel_copy(SBReader *reader, size_t threshold, size_t workers,
+                          void (*run)(void *pool, void (*task)(void *arg, size_t i), void *arg, size_t n), void *pool);
+
+/*
+ * Sets a limit on the range data a sparse buffer reader holds in memory.
+ *
+ * Once loading leaves more than limit bytes of range data in memory, the least
+ * recently read or loaded ranges are written to an unlinked temporary file in dir,
+ * and mapped back from it, until no more than limit bytes are left. Spilled ranges
+ * are then read back from the file, through the page cache, as they are accessed,
+ * and their pages may be dropped under memory pressure, rather than counting as the
+ * process's own memory. Spilling is best effort, and ranges stay in memory if the
+ * file cannot be written to. The limit is only checked when ranges are loaded, and
+ * when it is set, so removing ranges does not bring spilled ones back into memory.
+ *
+ * Space in the file freed by removing spilled ranges is reused by later spills,
+ * and the file is shrunk when its end is freed, so it stays about as large as the
+ * most data it has held at once, plus gaps too small to reuse. On Linux, freed
+ * space is also given back to the file system at once.
+ *
+ * Lock-free reads, through views, cursors and batches of readers with
+ * SB_LOCK_FREE_READS, do not count as uses. The limit is still kept, but ranges
+ * only read that way are spilled in the order they were loaded, even while in use,
+ * so the ranges left in memory are only roughly the most recently used ones.
+ *
+ * Data shared with snapshots or clones is not spilled, and sparse mapped readers
+ * cannot spill. Only supported on POSIX systems.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * dir    - The directory to create the spill file in, or NULL to stop spilling.
+ *              Ranges which were already spilled stay in their file either way.
+ *   * limit  - The most bytes of range data to hold in memory.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_set_spill(SBReader *reader, const char *dir, size_t limit, SBError *err);
+
+/*
+ * Gets the number of bytes of range data a sparse buffer reader holds in memory.
+ *
+ * This does not count ranges which are spilled, or which point into a mapped file
+ * or sparse mapping.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view of one.
+ *
+ * Returns:
+ *   The number of bytes of range data held in memory.
+ */
+size_t sb_resident_size(SBReader *reader);
+
 /*
  * Seek to a given position in the sparse buffer.
  *
@@ -187,4 +694,651 @@ size_t sb_read(SBReader *reader, uint8_t *buf, size_t size, SBError *err);
  */
 int sb_seek(SBReader *reader, size_t offset, SBWhence whence, size_t *pos, SBError *err);
 
+/*
+ * Lists the holes (unloaded spans) inside a given span of the sparse buffer.
+ *
+ * Holes are found in a single pass over the loaded ranges, and nothing is
+ * allocated. Holes separated by less than gap_merge_threshold loaded bytes
+ * are coalesced into a single hole, so that fewer, larger fetches can be
+ * made to fill them.
+ *
+ * Arguments:
+ *   * reader              - A pointer to a sparse buffer reader pointer allocated by
+ *                           sb_new_reader().
+ *   * off                 - The starting position of the span to check.
+ *   * len                 - The length of the span to check.
+ *   * out                 - A user supplied array the holes are written to, in order.
+ *   * max                 - The number of entries available in out.
+ *   * gap_merge_threshold - Loaded gaps smaller than this between two holes are
+ *                           bridged. Zero disables bridging.
+ *   * count               - A user supplied buffer in which the total number of holes
+ *                           is written. This may be larger than max, in which case
+ *                           only the first max holes are written to out.
+ *   * err                 - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_missing_ranges(SBReader *reader, size_t off, size_t len, SBRange *out, size_t max,
+                      size_t gap_merge_threshold, size_t *count, SBError *err);
+
+/*
+ * Initializes a bitstream reader over a span of a sparse buffer.
+ *
+ * Bits are read most significant bit first, directly from the loaded ranges,
+ * and unloaded ranges read as zero bits. The bitstream reader has its own
+ * position, and does not use or change the position of the sparse buffer reader.
+ *
+ * The sparse buffer reader may be changed while a bitstream reader is in use.
+ * Bits already cached are not updated.
+ *
+ * Arguments:
+ *   * br     - A user supplied bitstream reader.
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * off    - The starting position of the span to read bits from.
+ *   * len    - The length in bytes of the span to read bits from.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_bitreader_init(SBBitReader *br, SBReader *reader, size_t off, size_t len, SBError *err);
+
+/*
+ * Reads bits from a bitstream reader.
+ *
+ * Arguments:
+ *   * br  - A bitstream reader initialized with sb_bitreader_init().
+ *   * n   - The number of bits to read, up to 64.
+ *   * val - A user supplied buffer in which the bits read are written.
+ *   * err - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_bitreader_read(SBBitReader *br, unsigned int n, uint64_t *val, SBError *err);
+
+/*
+ * Skips bits in a bitstream reader.
+ *
+ * Arguments:
+ *   * br  - A bitstream reader initialized with sb_bitreader_init().
+ *   * n   - The number of bits to skip.
+ *   * err - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_bitreader_skip(SBBitReader *br, size_t n, SBError *err);
+
+/*
+ * Reads an unsigned Exp-Golomb code, ue(v), from a bitstream reader.
+ *
+ * Arguments:
+ *   * br  - A bitstream reader initialized with sb_bitreader_init().
+ *   * val - A user supplied buffer in which the decoded value is written.
+ *   * err - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_bitreader_read_ue(SBBitReader *br, uint64_t *val, SBError *err);
+
+/*
+ * Reads a signed Exp-Golomb code, se(v), from a bitstream reader.
+ *
+ * Arguments:
+ *   * br  - A bitstream reader initialized with sb_bitreader_init().
+ *   * val - A user supplied buffer in which the decoded value is written.
+ *   * err - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_bitreader_read_se(SBBitReader *br, int64_t *val, SBError *err);
+
+/*
+ * Skips to the next byte boundary in a bitstream reader.
+ *
+ * Arguments:
+ *   * br  - A bitstream reader initialized with sb_bitreader_init().
+ *   * err - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_bitreader_align(SBBitReader *br, SBError *err);
+
+/*
+ * Gets the number of bits read from a bitstream reader.
+ *
+ * Arguments:
+ *   * br - A bitstream reader initialized with sb_bitreader_init().
+ *
+ * Returns:
+ *   The number of bits read or skipped since the start of its span.
+ */
+size_t sb_bitreader_tell(SBBitReader *br);
+
+/*
+ * Gets the number of bits left in a bitstream reader.
+ *
+ * Arguments:
+ *   * br - A bitstream reader initialized with sb_bitreader_init().
+ *
+ * Returns:
+ *   The number of bits left until the end of its span.
+ */
+size_t sb_bitreader_left(SBBitReader *br);
+
+/*
+ * Finds the first occurence of a byte pattern in a span of the sparse buffer.
+ *
+ * Loaded ranges are searched in place, and matches may straddle range boundaries.
+ * Unloaded ranges read as zeroes, as with sb_read(), so they can be part of a
+ * match only where the pattern has zeroes.
+ *
+ * Arguments:
+ *   * reader     - A pointer to a sparse buffer reader pointer allocated by
+ *                  sb_new_reader().
+ *   * off        - The starting position of the span to search.
+ *   * len        - The length of the span to search. Matches must lie entirely inside it.
+ *   * needle     - The byte pattern to search for.
+ *   * needle_len - The length of the byte pattern.
+ *   * found      - A user supplied buffer in which the position of the match is written.
+ *   * err        - A user supplied error buffer.
+ *
+ * Returns:
+ *   1 if the pattern was found, 0 if it was not, and < 0 on error.
+ */
+int sb_find(SBReader *reader, size_t off, size_t len, const uint8_t *needle, size_t needle_len,
+            size_t *found, SBError *err);
+
+/*
+ * Initializes an Annex B start code scanner over a span of a sparse buffer.
+ *
+ * Loaded ranges are scanned in place for 00 00 01 start codes. Ranges which
+ * touch are always merged when loaded, so a start code never spans two of them.
+ * Start codes are never reported inside unloaded ranges, even though they read
+ * as zeroes.
+ *
+ * Arguments:
+ *   * sc     - A user supplied start code scanner.
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * off    - The starting position of the span to scan.
+ *   * len    - The length of the span to scan.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_scan_start_codes_init(SBStartCodeScanner *sc, SBReader *reader, size_t off, size_t len, SBError *err);
+
+/*
+ * Finds the next start code in an Annex B start code scanner.
+ *
+ * Arguments:
+ *   * sc       - A start code scanner initialized with sb_scan_start_codes_init().
+ *   * code_pos - A user supplied buffer in which the position of the start code is
+ *                written. This includes the leading zero byte of four byte start
+ *                codes, if it is loaded and inside the span.
+ *   * nal_pos  - A user supplied buffer in which the position of the first byte of
+ *                the NAL unit following the start code is written.
+ *
+ * Returns:
+ *   1 if a start code was found, and 0 at the end of the span.
+ */
+int sb_scan_start_codes_next(SBStartCodeScanner *sc, size_t *code_pos, size_t *nal_pos);
+
+/*
+ * Hashes a span of the sparse buffer.
+ *
+ * Loaded ranges are hashed in place, and unloaded ranges are hashed as zeroes
+ * without reading any. The hash of each whole loaded range is cached, until
+ * the range is changed by loading or removing ranges.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * off    - The starting position of the span to hash.
+ *   * len    - The length of the span to hash.
+ *   * algo   - The hash algorithm to use. See: SBHashAlgo.
+ *   * hash   - A user supplied buffer in which the hash is written.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_hash(SBReader *reader, size_t off, size_t len, SBHashAlgo algo, uint64_t *hash, SBError *err);
+
+/*
+ * Initializes an iterator over the extents of a span of a sparse buffer.
+ *
+ * The iterator yields, in order, each loaded extent with a pointer to its data,
+ * where it lives in the sparse buffer, and each unloaded extent in between, so
+ * that the whole span can be processed without copying it out.
+ *
+ * Arguments:
+ *   * it     - A user supplied range iterator.
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader().
+ *   * off    - The starting position of the span to iterate over.
+ *   * len    - The length of the span to iterate over.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_range_iter_init(SBRangeIter *it, SBReader *reader, size_t off, size_t len, SBError *err);
+
+/*
+ * Gets the next extent from a range iterator.
+ *
+ * Arguments:
+ *   * it    - A range iterator initialized with sb_range_iter_init().
+ *   * range - A user supplied buffer in which the position and size of the
+ *             extent are written.
+ *   * data  - A user supplied buffer in which a pointer to the extent's data is
+ *             written, or NULL if the extent is not loaded. The data is only
+ *             valid until ranges are next loaded or removed from the reader.
+ *             See: sb_lock_shared().
+ *
+ * Returns:
+ *   1 if an extent was returned, and 0 at the end of the span.
+ */
+int sb_range_iter_next(SBRangeIter *it, SBRange *range, const uint8_t **data);
+
+/*
+ * Initializes a cursor over a sparse buffer reader.
+ *
+ * A cursor is a read position, independent of the reader's own, which remembers
+ * the range it last read from, so that reading onwards does not search the
+ * ranges from the start. Any number of cursors may share a reader, and with
+ * thread-safe readers, each may be used by a different thread.
+ *
+ * Arguments:
+ *   * cur    - A user supplied cursor.
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_cursor_init(SBCursor *cur, SBReader *reader);
+
+/*
+ * Read bytes at the current position of a cursor.
+ *
+ * Zeroes will be returned for any ranges not loaded into the sparse buffer.
+ *
+ * Arguments:
+ *   * cur  - A cursor initialized with sb_cursor_init().
+ *   * buf  - A user supplied buffer to read into.
+ *   * size - The number of bytes to read.
+ *   * err  - A user supplied error buffer.
+ *
+ * Returns:
+ *   size on success, != size on error.
+ */
+size_t sb_cursor_read(SBCursor *cur, uint8_t *buf, size_t size, SBError *err);
+
+/*
+ * Seek a cursor to a given position in the sparse buffer.
+ *
+ * Arguments:
+ *   * cur    - A cursor initialized with sb_cursor_init().
+ *   * offset - The offset to seek to.
+ *   * whence - From whence to seek. See: SBWhence.
+ *   * pos    - A user supplied buffer in which the absolute position that
+ *              has been seeked to is written.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_cursor_seek(SBCursor *cur, size_t offset, SBWhence whence, size_t *pos, SBError *err);
+
+/*
+ * Gets the current position of a cursor.
+ *
+ * Arguments:
+ *   * cur - A cursor initialized with sb_cursor_init().
+ *
+ * Returns:
+ *   The current position of the cursor.
+ */
+size_t sb_cursor_tell(SBCursor *cur);
+
+/*
+ * Registers interest in a span of a sparse buffer being loaded.
+ *
+ * Once sb_load_range() has loaded the whole span, or the reader is resized to end
+ * before it, func is called with opaque from the thread that loaded or resized,
+ * after the reader has been unlocked. If func is NULL, opaque is instead queued,
+ * to be taken with sb_notify_next(), and the fd returned by sb_notify_fd() becomes
+ * readable, so that event loops may wait on it. Each registration is notified once.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ *   * off    - The start of the span.
+ *   * len    - The length of the span.
+ *   * func   - The function to call, or NULL to queue the notification.
+ *   * opaque - A user supplied pointer identifying the registration.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 if registered, 1 if the span is already loaded, in which case nothing is
+ *   registered, and < 0 on error.
+ */
+int sb_notify_add(SBReader *reader, size_t off, size_t len, void (*func)(void *opaque), void *opaque, SBError *err);
+
+/*
+ * Cancels all registrations with a given opaque pointer, including queued ones not
+ * yet taken. It does not wait for a callback already being called.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ *   * opaque - The pointer passed to sb_notify_add().
+ */
+void sb_notify_cancel(SBReader *reader, void *opaque);
+
+/*
+ * Takes the next queued notification of a reader. The fd returned by sb_notify_fd()
+ * stops being readable once all have been taken.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ *   * opaque - A user supplied buffer in which the pointer passed to
+ *              sb_notify_add() is written.
+ *
+ * Returns:
+ *   1 if a notification was taken, and 0 if none are queued.
+ */
+int sb_notify_next(SBReader *reader, void **opaque);
+
+/*
+ * Gets a file descriptor which is readable while queued notifications are waiting
+ * to be taken with sb_notify_next(). It is an eventfd where supported, and the read
+ * end of a pipe otherwise. It is owned by the reader, and must not be read from or
+ * closed by the user.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   The file descriptor on success, and < 0 on error.
+ */
+int sb_notify_fd(SBReader *reader, SBError *err);
+
+/*
+ * Creates a new sharded sparse buffer reader, and optionally uses user-provided allocators.
+ *
+ * A sharded reader splits [0, size) into equal, contiguous shards, each with its own
+ * ranges and lock, so that loads into different shards may run at the same time
+ * from different threads. Loads, removals and reads may span several shards, in
+ * which case they lock all of them, and are seen whole by other threads.
+ *
+ * Arguments:
+ *   * size           - The size of the sparse buffer for the reader.
+ *   * count          - The number of shards. If size is not a multiple of it, the
+ *                      shard size is rounded up, which may leave fewer shards.
+ *   * custom_alloc   - User provided allocation function, which must have the same semantics as malloc,
+ *                      or NULL to use the default allocators.
+ *   * custom_realloc - User provided reallocation function, which must have the same semantics as realloc.
+ *   * custom_free    - User provided free functon, which must have the same semntics as free.
+ *   * err            - A user supplied error buffer.
+ *
+ * Returns:
+ *   A new sharded sparse buffer reader, which must be freed with sb_free_sharded_reader()
+ *   after use, or NULL on error.
+ */
+SBShardedReader *sb_new_sharded_reader(size_t size, size_t count, void *(*custom_alloc)(size_t size),
+                                       void *(*custom_realloc)(void *ptr, size_t size), void (*custom_free)(void *ptr),
+                                       SBError *err);
+
+/*
+ * Frees a sharded sparse buffer reader and all of its loaded ranges.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sharded sparse buffer reader pointer allocated by
+ *              sb_new_sharded_reader(). It is set to NULL.
+ */
+void sb_free_sharded_reader(SBShardedReader **reader);
+
+/*
+ * Loads a range into a sharded sparse buffer. This is the same as sb_load_range().
+ *
+ * A range spanning several shards is loaded into each in turn, under all of their
+ * locks. If loading into one fails, which only happens when memory runs out, the
+ * shards before it keep their part of the range, and are not rolled back. The
+ * error names the shard which failed, and which were loaded.
+ *
+ * Arguments:
+ *   * reader  - A pointer to a sharded sparse buffer reader pointer allocated by
+ *               sb_new_sharded_reader().
+ *   * pos     - The position in the sparse buffer to load the range at.
+ *   * buf     - The range data.
+ *   * bufsize - The size of the range data.
+ *   * err     - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_sharded_load_range(SBShardedReader *reader, size_t pos, uint8_t *buf, size_t bufsize, SBError *err);
+
+/*
+ * Removes a range from a sharded sparse buffer. This is the same as sb_remove_range().
+ *
+ * As with sb_sharded_load_range(), the shards before one which fails to remove
+ * its part of the range keep it removed, and the error names them.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sharded sparse buffer reader pointer allocated by
+ *              sb_new_sharded_reader().
+ *   * start  - The start of the range to remove.
+ *   * end    - The end of the range to remove (inclusive).
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_sharded_remove_range(SBShardedReader *reader, size_t start, size_t end, SBError *err);
+
+/*
+ * Reads bytes at a given position of a sharded sparse buffer.
+ *
+ * Zeroes will be returned for any ranges not loaded into the sparse buffer.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sharded sparse buffer reader pointer allocated by
+ *              sb_new_sharded_reader().
+ *   * pos    - The position to read from.
+ *   * buf    - A user supplied buffer to read into.
+ *   * size   - The number of bytes to read.
+ *   * err    - A user supplied error buffer.
+ *
+ * Returns:
+ *   size on success, != size on error.
+ */
+size_t sb_sharded_read(SBShardedReader *reader, size_t pos, uint8_t *buf, size_t size, SBError *err);
+
+/*
+ * Lists the holes inside a given span of a sharded sparse buffer. This is the same
+ * as sb_missing_ranges(), and holes are joined across shards.
+ *
+ * Arguments:
+ *   * reader              - A pointer to a sharded sparse buffer reader pointer allocated by
+ *                           sb_new_sharded_reader().
+ *   * off                 - The starting position of the span to check.
+ *   * len                 - The length of the span to check.
+ *   * out                 - A user supplied array the holes are written to, in order.
+ *   * max                 - The number of entries available in out.
+ *   * gap_merge_threshold - Loaded gaps smaller than this between two holes are
+ *                           bridged. Zero disables bridging.
+ *   * count               - A user supplied buffer in which the total number of holes
+ *                           is written.
+ *   * err                 - A user supplied error buffer.
+ *
+ * Returns:
+ *   0 on success, and < 0 on error.
+ */
+int sb_sharded_missing_ranges(SBShardedReader *reader, size_t off, size_t len, SBRange *out, size_t max,
+                              size_t gap_merge_threshold, size_t *count, SBError *err);
+
+/*
+ * Takes the shared lock of a thread-safe sparse buffer reader.
+ *
+ * This keeps ranges from being loaded or removed by other threads, e.g. while
+ * using data returned by sb_range_iter_next(). Reading and seeking functions,
+ * on the reader itself or its views, may still be called while holding it, except
+ * for sb_read_wait(), which could then wait forever for a load. Does nothing for
+ * other readers.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ */
+void sb_lock_shared(SBReader *reader);
+
+/*
+ * Releases the shared lock of a thread-safe sparse buffer reader taken with
+ * sb_lock_shared().
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ */
+void sb_unlock_shared(SBReader *reader);
+
+/*
+ * Inline big-endian readers.
+ *
+ * These read a value at the current position of the reader, and advance it. When
+ * the value lies entirely inside the loaded range at the current position, this
+ * is a bounds check and a load; otherwise, they fall back to sb_read().
+ *
+ * All of them return 0 on success, and < 0 on error.
+ */
+
+/*
+ * Gets the read window of a sparse buffer reader.
+ *
+ * The window stays at the same address for the life of the reader, and may be
+ * read from and advanced directly, as the inline readers below do, by a thread
+ * which could call sb_read() on the reader at that point. It is updated by every
+ * other call on the reader, and emptied whenever its ranges change.
+ *
+ * Arguments:
+ *   * reader - A pointer to a sparse buffer reader pointer allocated by
+ *              sb_new_reader(), or a view.
+ *
+ * Returns:
+ *   The window of the reader.
+ */
+SBWindow *sb_window(SBReader *reader);
+
+/* Returns the number of loaded bytes directly readable at the current position. */
+static inline size_t sb_window_avail(const SBWindow *w)
+{
+    return (size_t) (w->end - w->cur);
+}
+
+/* Consumes n bytes from the window, returning a pointer to them. */
+static inline const uint8_t *sb_window_take(SBWindow *w, size_t n)
+{
+    const uint8_t *ret = w->cur;
+    w->cur += n;
+    w->pos += n;
+    return ret;
+}
+
+static inline uint16_t sb_be16(const uint8_t *p)
+{
+    return (uint16_t) ((uint16_t) p[0] << 8 | p[1]);
+}
+
+static inline uint32_t sb_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline uint64_t sb_be64(const uint8_t *p)
+{
+    return (uint64_t) sb_be32(p) << 32 | sb_be32(p + 4);
+}
+
+static inline int sb_read_u8(SBReader *reader, uint8_t *val, SBError *err)
+{
+    SBWindow *w = sb_window(reader);
+    if (sb_window_avail(w) >= 1) {
+        *val = *sb_window_take(w, 1);
+        return 0;
+    }
+    return sb_read(reader, val, 1, err) == 1 ? 0 : -1;
+}
+
+static inline int sb_read_u16be(SBReader *reader, uint16_t *val, SBError *err)
+{
+    SBWindow *w = sb_window(reader);
+    uint8_t buf[2];
+    if (sb_window_avail(w) >= 2) {
+        *val = sb_be16(sb_window_take(w, 2));
+        return 0;
+    }
+    if (sb_read(reader, &buf[0], 2, err) != 2)
+        return -1;
+    *val = sb_be16(&buf[0]);
+    return 0;
+}
+
+static inline int sb_read_u32be(SBReader *reader, uint32_t *val, SBError *err)
+{
+    SBWindow *w = sb_window(reader);
+    uint8_t buf[4];
+    if (sb_window_avail(w) >= 4) {
+        *val = sb_be32(sb_window_take(w, 4));
+        return 0;
+    }
+    if (sb_read(reader, &buf[0], 4, err) != 4)
+        return -1;
+    *val = sb_be32(&buf[0]);
+    return 0;
+}
+
+static inline int sb_read_u64be(SBReader *reader, uint64_t *val, SBError *err)
+{
+    SBWindow *w = sb_window(reader);
+    uint8_t buf[8];
+    if (sb_window_avail(w) >= 8) {
+        *val = sb_be64(sb_window_take(w, 8));
+        return 0;
+    }
+    if (sb_read(reader, &buf[0], 8, err) != 8)
+        return -1;
+    *val = sb_be64(&buf[0]);
+    return 0;
+}
+
+/* Reads a four character code, such as an ISO BMFF box type, as raw bytes. */
+static inline int sb_read_fourcc(SBReader *reader, uint8_t fourcc[4], SBError *err)
+{
+    SBWindow *w = sb_window(reader);
+    if (sb_window_avail(w) >= 4) {
+        const uint8_t *p = sb_window_take(w, 4);
+        fourcc[0] = p[0];
+        fourcc[1] = p[1];
+        fourcc[2] = p[2];
+        fourcc[3] = p[3];
+        return 0;
+    }
+    return sb_read(reader, fourcc, 4, err) == 4 ? 0 : -1;
+}
+
 #endif
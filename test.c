@@ -14,12 +14,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "sparsebuffer.h"
 
@@ -48,6 +54,17 @@ void *test_realloc(void *ptr, size_t size)
     return newptr + 4;
 }
 
+/* Fails every allocation while set, after the first alloc_fail_after, to test recovery from allocation failures. */
+static int alloc_fail       = 0;
+static int alloc_fail_after = 0;
+
+void *flaky_alloc(size_t size)
+{
+    if (alloc_fail && alloc_fail_after-- <= 0)
+        return NULL;
+    return test_alloc(size);
+}
+
 void test_free(void *ptr)
 {
     assert(!memcmp(ptr - 4, "TEST", 4));
@@ -55,6 +72,228 @@ void test_free(void *ptr)
     free(ptr - 4);
 }
 
+static int naive_find(const uint8_t *hay, size_t off, size_t len, const uint8_t *needle, size_t nlen, size_t *found)
+{
+    for (size_t i = off; i + nlen <= off + len; i++) {
+        if (!memcmp(hay + i, needle, nlen)) {
+            *found = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t ref_crc32c(const uint8_t *buf, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= buf[i];
+        for (int j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    }
+    return ~crc;
+}
+
+typedef struct ThreadTest {
+    SBReader *reader;
+    unsigned int seed;
+    int failed;
+} ThreadTest;
+
+static uint8_t pattern(size_t pos)
+{
+    return (uint8_t) (pos * 31 + 7);
+}
+
+static unsigned int lcg(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+/* Reads random spans, which must only ever contain zeroes or the loaded pattern. */
+static void *reader_thread(void *arg)
+{
+    ThreadTest *t = arg;
+    char e[1024];
+    SBError err = { &e[0], 1024 };
+    uint8_t buf[256];
+
+    SBReader *v = sb_new_view(t->reader, 0, 4096, &err);
+    if (v == NULL) {
+        t->failed = 1;
+        return NULL;
+    }
+
+    SBCursor cur;
+    sb_cursor_init(&cur, t->reader);
+
+    for (int i = 0; i < 2000 && !t->failed; i++) {
+        size_t off = lcg(&t->seed) % 3840, len = 1 + lcg(&t->seed) % 256, pos;
+        uint64_t hash;
+
+        if (sb_seek(v, off, SB_SET, &pos, &err) < 0 || sb_read(v, &buf[0], len, &err) != len ||
+            sb_hash(v, off, len, SB_HASH_CRC32C, &hash, &err) < 0) {
+            t->failed = 1;
+            break;
+        }
+        for (size_t j = 0; j < len; j++) {
+            if (buf[j] != 0 && buf[j] != pattern(off + j))
+                t->failed = 1;
+        }
+
+        if (sb_cursor_seek(&cur, off, SB_SET, &pos, &err) < 0 || sb_cursor_read(&cur, &buf[0], len, &err) != len) {
+            t->failed = 1;
+            break;
+        }
+        for (size_t j = 0; j < len; j++) {
+            if (buf[j] != 0 && buf[j] != pattern(off + j))
+                t->failed = 1;
+        }
+
+        SBReadReq req[2] = { { off + len / 2, len - len / 2, &buf[len / 2] }, { off, len / 2 + 1, &buf[0] } };
+        if (sb_read_batch(t->reader, &req[0], 2, &err) < 0) {
+            t->failed = 1;
+            break;
+        }
+        for (size_t j = 0; j < len; j++) {
+            if (buf[j] != 0 && buf[j] != pattern(off + j))
+                t->failed = 1;
+        }
+
+        /* The position of the root reader is shared by all the readers. */
+        if (sb_seek(t->reader, off, SB_SET, &pos, &err) < 0 || sb_read(t->reader, &buf[0], 1, &err) != 1) {
+            t->failed = 1;
+            break;
+        }
+    }
+
+    sb_free_reader(&v);
+
+    return NULL;
+}
+
+typedef struct WaitTest {
+    SBReader *reader;
+    size_t size;
+    size_t ret;
+    uint8_t buf[1000];
+} WaitTest;
+
+/* Blocks until its whole span is loaded. */
+static void *wait_thread(void *arg)
+{
+    WaitTest *t = arg;
+    char e[1024];
+    SBError err = { &e[0], 1024 };
+
+    t->ret = sb_read_wait(t->reader, &t->buf[0], t->size, -1, &err);
+
+    return NULL;
+}
+
+static void count_notify(void *opaque)
+{
+    (*(int *) opaque)++;
+}
+
+typedef struct CountPool {
+    size_t runs;
+    size_t tasks;
+} CountPool;
+
+/* Runs tasks serially, in reverse, counting them. */
+static void count_run(void *pool, void (*task)(void *arg, size_t i), void *arg, size_t n)
+{
+    CountPool *p = pool;
+    p->runs++;
+    for (size_t i = n; i > 0; i--, p->tasks++)
+        task(arg, i - 1);
+}
+
+typedef struct SnapTest {
+    SBReader *snap;
+    const uint8_t *want;
+    int failed;
+} SnapTest;
+
+/* Keeps reading a snapshot, which must never change. */
+static void *snap_thread(void *arg)
+{
+    SnapTest *t = arg;
+    char e[1024];
+    SBError err = { &e[0], 1024 };
+    uint8_t buf[4096];
+    size_t pos;
+
+    for (int i = 0; i < 200 && !t->failed; i++) {
+        uint64_t hash;
+        if (sb_seek(t->snap, 0, SB_SET, &pos, &err) < 0 || sb_read(t->snap, &buf[0], 4096, &err) != 4096 ||
+            memcmp(&buf[0], t->want, 4096) != 0 || sb_hash(t->snap, 0, 4096, SB_HASH_CRC32C, &hash, &err) < 0)
+            t->failed = 1;
+    }
+
+    return NULL;
+}
+
+static int fd_readable(int fd)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 1;
+}
+
+typedef struct ShardTest {
+    SBShardedReader *reader;
+    size_t start;
+    size_t end;
+    int failed;
+} ShardTest;
+
+/* Loads its part of the pattern in small pieces, some crossing into the next part. */
+static void *shard_thread(void *arg)
+{
+    ShardTest *t = arg;
+    char e[1024];
+    SBError err = { &e[0], 1024 };
+    uint8_t buf[300];
+
+    for (size_t pos = t->start; pos < t->end; pos += 250) {
+        size_t len = pos + 300 < 20000 ? 300 : 20000 - pos;
+        for (size_t j = 0; j < len; j++)
+            buf[j] = pattern(pos + j);
+        if (sb_sharded_load_range(t->reader, pos, &buf[0], len, &err) < 0)
+            t->failed = 1;
+    }
+
+    return NULL;
+}
+
+/* Loads and removes random spans of the pattern. */
+static void *writer_thread(void *arg)
+{
+    ThreadTest *t = arg;
+    char e[1024];
+    SBError err = { &e[0], 1024 };
+    uint8_t buf[512];
+
+    for (int i = 0; i < 2000 && !t->failed; i++) {
+        size_t off = lcg(&t->seed) % 3584, len = 1 + lcg(&t->seed) % 512;
+        int ret;
+
+        if (lcg(&t->seed) % 3 == 0) {
+            ret = sb_remove_range(t->reader, off, off + len - 1, &err);
+        } else {
+            for (size_t j = 0; j < len; j++)
+                buf[j] = pattern(off + j);
+            ret = sb_load_range(t->reader, off, &buf[0], len, &err);
+        }
+        if (ret < 0)
+            t->failed = 1;
+    }
+
+    return NULL;
+}
+
 int main()
 {
     char e[1024];
@@ -186,6 +425,13 @@ int main()
         return -1;
     }
 
+    size_t pos;
+    ret = sb_seek(r, 0, SB_SET, &pos, &err);
+    if (ret < 0) {
+        printf("Failed to seek: %s\n", err.error);
+        return 1;
+    }
+
     memset(&buf[0], 0, 50);
     read = sb_read(r, &buf[0], 50, &err);
     if (read != 50) {
@@ -205,8 +451,1639 @@ int main()
         }
     }
 
+    sb_free_reader(&r);
+
+    r = sb_new_reader_custom_alloc(100, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+
+    /* Loaded: [10, 20), [22, 30), [60, 70) */
+    uint8_t loc7[10] = { 0 };
+    size_t loads[3][2] = { { 10, 10 }, { 22, 8 }, { 60, 10 } };
+    for (size_t i = 0; i < 3; i++) {
+        ret = sb_load_range(r, loads[i][0], &loc7[0], loads[i][1], &err);
+        if (ret < 0) {
+            printf("Failed to load range: %s\n", err.error);
+            return 1;
+        }
+    }
+
+    SBRange holes[4];
+    size_t nbholes;
+    ret = sb_missing_ranges(r, 0, 100, &holes[0], 4, 0, &nbholes, &err);
+    if (ret < 0) {
+        printf("Failed to get missing ranges: %s\n", err.error);
+        return 1;
+    }
+    SBRange expected4[4] = { { 0, 10 }, { 20, 2 }, { 30, 30 }, { 70, 30 } };
+    if (nbholes != 4) {
+        printf("Expected 4 holes, but got %zu.\n", nbholes);
+        return 1;
+    }
+    for (size_t i = 0; i < 4; i++) {
+        if (holes[i].pos != expected4[i].pos || holes[i].size != expected4[i].size) {
+            printf("Expected hole %zu to be [%zu, +%zu), but got [%zu, +%zu).\n", i,
+                   expected4[i].pos, expected4[i].size, holes[i].pos, holes[i].size);
+            return 1;
+        }
+    }
+
+    ret = sb_missing_ranges(r, 15, 50, &holes[0], 1, 9, &nbholes, &err);
+    if (ret < 0) {
+        printf("Failed to get missing ranges: %s\n", err.error);
+        return 1;
+    }
+    if (nbholes != 1 || holes[0].pos != 20 || holes[0].size != 40) {
+        printf("Expected bridged hole [20, +40), but got %zu holes, first [%zu, +%zu).\n",
+               nbholes, holes[0].pos, holes[0].size);
+        return 1;
+    }
+
+    ret = sb_missing_ranges(r, 10, 10, &holes[0], 1, 0, &nbholes, &err);
+    if (ret < 0 || nbholes != 0) {
+        printf("Expected no holes in a loaded range.\n");
+        return 1;
+    }
+
+    uint8_t loc8[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    ret = sb_load_range(r, 18, &loc8[0], 8, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+
+    uint8_t whole[100];
+    read = sb_read(r, &whole[0], 100, &err);
+    if (read != 100) {
+        printf("Failed to read sparsebuffer: %s\n", err.error);
+        return 1;
+    }
+
+    uint8_t reqbuf[4][20];
+    SBReadReq reqs[4] = { { 55, 10, reqbuf[0] }, { 5, 20, reqbuf[1] }, { 17, 4, reqbuf[2] }, { 90, 10, reqbuf[3] } };
+    for (int sorted = 0; sorted < 2; sorted++) {
+        if (sorted) {
+            SBReadReq tmp = reqs[0];
+            reqs[0]       = reqs[1];
+            reqs[1]       = reqs[2];
+            reqs[2]       = tmp;
+        }
+
+        memset(&reqbuf[0][0], 0xFF, sizeof(reqbuf));
+        ret = sb_read_batch(r, &reqs[0], 4, &err);
+        if (ret < 0) {
+            printf("Failed to batch read: %s\n", err.error);
+            return 1;
+        }
+        for (size_t i = 0; i < 4; i++) {
+            if (memcmp(reqs[i].buf, &whole[reqs[i].pos], reqs[i].size)) {
+                printf("Batched read request %zu at %zu does not match.\n", i, reqs[i].pos);
+                return 1;
+            }
+        }
+    }
+
+    sb_free_reader(&r);
+
+    /* One span, and one batched request, across several ranges with holes between them. */
+    r = sb_new_reader_custom_alloc(100, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    for (int i = 0; i < 3; i++) {
+        uint8_t part[5];
+        memset(&part[0], i + 1, 5);
+        ret = sb_load_range(r, 10 + 30 * i, &part[0], 5, &err);
+        if (ret < 0) {
+            printf("Failed to load range: %s\n", err.error);
+            return 1;
+        }
+    }
+
+    uint8_t span[100], bspan[100];
+    SBReadReq sreq = { 0, 100, &bspan[0] };
+    memset(&span[0], 0xFF, 100);
+    memset(&bspan[0], 0xFF, 100);
+    if (sb_read(r, &span[0], 100, &err) != 100 || sb_read_batch(r, &sreq, 1, &err) < 0) {
+        printf("Failed to read sparsebuffer: %s\n", err.error);
+        return 1;
+    }
+    for (size_t i = 0; i < 100; i++) {
+        uint8_t want = i % 30 >= 10 && i % 30 < 15 ? (uint8_t) (i / 30 + 1) : 0;
+        if (span[i] != want || bspan[i] != want) {
+            printf("Expected %"PRIu8" at pos %zu, but got %"PRIu8" and %"PRIu8".\n", want, i, span[i], bspan[i]);
+            return 1;
+        }
+    }
+
+    sb_free_reader(&r);
+
+    r = sb_new_reader_custom_alloc(32, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+
+    uint8_t loc9[16];
+    for (size_t i = 0; i < 16; i++)
+        loc9[i] = 0x10 + i;
+    ret = sb_load_range(r, 0, &loc9[0], 16, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint8_t v8;
+        uint16_t v16;
+        uint32_t v32;
+        uint64_t v64;
+        uint8_t fourcc[4];
+
+        ret = sb_seek(r, 0, SB_SET, &pos, &err);
+        if (ret < 0) {
+            printf("Failed to seek: %s\n", err.error);
+            return 1;
+        }
+
+        SBWindow *w = sb_window(r);
+        if (w->pos != 0) {
+            printf("Bad read window position after a seek.\n");
+            return 1;
+        }
+
+        if (sb_read_u32be(r, &v32, &err) < 0 || v32 != 0x10111213) {
+            printf("Bad u32 read.\n");
+            return 1;
+        }
+        if (w->pos != 4 || sb_bytes_left(r) != 28 || sb_window_avail(w) != 12 || w->cur[0] != 0x14) {
+            printf("Bad read window after a read.\n");
+            return 1;
+        }
+        if (sb_read_u16be(r, &v16, &err) < 0 || v16 != 0x1415) {
+            printf("Bad u16 read.\n");
+            return 1;
+        }
+        if (sb_read_u8(r, &v8, &err) < 0 || v8 != 0x16) {
+            printf("Bad u8 read.\n");
+            return 1;
+        }
+        if (sb_read_u64be(r, &v64, &err) < 0 || v64 != 0x1718191A1B1C1D1EULL) {
+            printf("Bad u64 read.\n");
+            return 1;
+        }
+        if (sb_read_fourcc(r, &fourcc[0], &err) < 0 || memcmp(&fourcc[0], "\x1F\0\0\0", 4)) {
+            printf("Bad fourcc read across a range boundary.\n");
+            return 1;
+        }
+        if (sb_read_u64be(r, &v64, &err) < 0 || v64 != 0) {
+            printf("Bad u64 read in a hole.\n");
+            return 1;
+        }
+        if (sb_read_u64be(r, &v64, &err) == 0) {
+            printf("Read a u64 past EOF.\n");
+            return 1;
+        }
+    }
+
+    sb_free_reader(&r);
+
+    r = sb_new_reader_custom_alloc(256, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+
+    uint8_t loc10[64];
+    for (size_t i = 0; i < 64; i++)
+        loc10[i] = (uint8_t) (i * 37 + 11);
+    size_t loads2[3][2] = { { 3, 5 }, { 20, 64 }, { 100, 30 } };
+    for (size_t i = 0; i < 3; i++) {
+        ret = sb_load_range(r, loads2[i][0], &loc10[0], loads2[i][1], &err);
+        if (ret < 0) {
+            printf("Failed to load range: %s\n", err.error);
+            return 1;
+        }
+    }
+
+    uint8_t flat[256];
+    ret = sb_seek(r, 0, SB_SET, &pos, &err);
+    if (ret < 0 || sb_read(r, &flat[0], 256, &err) != 256) {
+        printf("Failed to read sparsebuffer: %s\n", err.error);
+        return 1;
+    }
+
+    SBBitReader br;
+    ret = sb_bitreader_init(&br, r, 1, 200, &err);
+    if (ret < 0) {
+        printf("Failed to init bitreader: %s\n", err.error);
+        return 1;
+    }
+    size_t bitpos = 8;
+    for (unsigned int n = 0; bitpos + n <= 201 * 8; n = (n + 7) % 65) {
+        uint64_t v, expected = 0;
+        for (unsigned int i = 0; i < n; i++)
+            expected = expected << 1 | ((flat[(bitpos + i) / 8] >> (7 - (bitpos + i) % 8)) & 1);
+
+        ret = sb_bitreader_read(&br, n, &v, &err);
+        if (ret < 0) {
+            printf("Failed to read %u bits at %zu: %s\n", n, bitpos, err.error);
+            return 1;
+        }
+        if (v != expected) {
+            printf("Expected %"PRIu64" for %u bits at %zu, but got %"PRIu64".\n", expected, n, bitpos, v);
+            return 1;
+        }
+        bitpos += n;
+        if (sb_bitreader_tell(&br) != bitpos - 8) {
+            printf("Bitreader position is wrong.\n");
+            return 1;
+        }
+    }
+    uint64_t v64;
+    if (sb_bitreader_read(&br, 64, &v64, &err) == 0) {
+        printf("Read bits past the end of the bitstream.\n");
+        return 1;
+    }
+
+    /* ue(v) 0, 1, 2, 3, 4 followed by the same codes as se(v). */
+    uint8_t golomb[6] = { 0xA6, 0x42, 0xD3, 0x21, 0x40, 0x00 };
+    ret = sb_load_range(r, 250, &golomb[0], 6, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+    ret = sb_bitreader_init(&br, r, 250, 6, &err);
+    if (ret < 0) {
+        printf("Failed to init bitreader: %s\n", err.error);
+        return 1;
+    }
+    for (uint64_t i = 0; i < 5; i++) {
+        uint64_t ue;
+        if (sb_bitreader_read_ue(&br, &ue, &err) < 0 || ue != i) {
+            printf("Bad ue(v) read %"PRIu64".\n", i);
+            return 1;
+        }
+    }
+    int64_t expected5[5] = { 0, 1, -1, 2, -2 };
+    for (size_t i = 0; i < 5; i++) {
+        int64_t se;
+        if (sb_bitreader_read_se(&br, &se, &err) < 0 || se != expected5[i]) {
+            printf("Bad se(v) read %zu.\n", i);
+            return 1;
+        }
+    }
+    if (sb_bitreader_align(&br, &err) < 0 || sb_bitreader_tell(&br) != 40) {
+        printf("Bad bitreader alignment.\n");
+        return 1;
+    }
+    uint64_t ue;
+    if (sb_bitreader_read_ue(&br, &ue, &err) == 0) {
+        printf("Read an invalid Exp-Golomb code.\n");
+        return 1;
+    }
+
+    ret = sb_seek(r, 0, SB_SET, &pos, &err);
+    if (ret < 0 || sb_read(r, &flat[0], 256, &err) != 256) {
+        printf("Failed to read sparsebuffer: %s\n", err.error);
+        return 1;
+    }
+
+    size_t spans[4][2] = { { 0, 256 }, { 5, 100 }, { 21, 63 }, { 90, 166 } };
+    uint8_t zeroneedle[10] = { 0 };
+    uint8_t missing[3]     = { 0xFE, 0xFD, 0xFC };
+    for (size_t i = 0; i < 4; i++) {
+        size_t off = spans[i][0], len = spans[i][1];
+        for (size_t npos = 0; npos < 256; npos += 7) {
+            for (size_t nlen = 1; nlen <= 40 && npos + nlen <= 256; nlen += 3) {
+                const uint8_t *needle = &flat[npos];
+                if (npos == 0) {
+                    needle = nlen <= 10 ? &zeroneedle[0] : &flat[npos];
+                } else if (npos == 7 && nlen <= 3) {
+                    needle = &missing[0];
+                }
+
+                size_t found = 0, expected = 0;
+                int eret = naive_find(&flat[0], off, len, needle, nlen, &expected);
+                ret      = sb_find(r, off, len, needle, nlen, &found, &err);
+                if (ret < 0) {
+                    printf("Failed to search: %s\n", err.error);
+                    return 1;
+                }
+                if (ret != eret || (ret == 1 && found != expected)) {
+                    printf("Search for %zu bytes from %zu in [%zu, +%zu) returned %d at %zu, expected %d at %zu.\n",
+                           nlen, npos, off, len, ret, found, eret, expected);
+                    return 1;
+                }
+            }
+        }
+    }
 
     sb_free_reader(&r);
 
+    r = sb_new_reader_custom_alloc(64, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+
+    uint8_t annexb1[13] = { 0, 0, 0, 1, 0x65, 0xAA, 0, 0, 1, 0x41, 0xBB, 0, 0 };
+    uint8_t annexb2[6]  = { 1, 2, 0, 0, 1, 6 };
+    ret = sb_load_range(r, 0, &annexb1[0], 13, &err);
+    if (ret == 0)
+        ret = sb_load_range(r, 20, &annexb2[0], 6, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+
+    size_t expected6[2][3][2] = { { { 0, 4 }, { 6, 9 }, { 22, 25 } }, { { 1, 4 }, { 6, 9 }, { 22, 25 } } };
+    for (size_t i = 0; i < 2; i++) {
+        SBStartCodeScanner sc;
+        ret = sb_scan_start_codes_init(&sc, r, i, 64 - i, &err);
+        if (ret < 0) {
+            printf("Failed to init start code scanner: %s\n", err.error);
+            return 1;
+        }
+        for (size_t j = 0; j < 3; j++) {
+            size_t code_pos, nal_pos;
+            ret = sb_scan_start_codes_next(&sc, &code_pos, &nal_pos);
+            if (ret != 1 || code_pos != expected6[i][j][0] || nal_pos != expected6[i][j][1]) {
+                printf("Expected start code at %zu with NAL at %zu, but got %d, %zu, %zu.\n",
+                       expected6[i][j][0], expected6[i][j][1], ret, code_pos, nal_pos);
+                return 1;
+            }
+        }
+        size_t code_pos, nal_pos;
+        if (sb_scan_start_codes_next(&sc, &code_pos, &nal_pos) != 0) {
+            printf("Found a start code in a hole at %zu.\n", code_pos);
+            return 1;
+        }
+    }
+
+    sb_free_reader(&r);
+
+    r = sb_new_reader_custom_alloc(4096, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+
+    uint8_t check[9] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    ret = sb_load_range(r, 0, &check[0], 9, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+    uint64_t hash;
+    ret = sb_hash(r, 0, 9, SB_HASH_CRC32C, &hash, &err);
+    if (ret < 0 || hash != 0xE3069283) {
+        printf("Bad CRC32C check value.\n");
+        return 1;
+    }
+
+    uint8_t loc11[1004];
+    for (size_t i = 0; i < 1004; i++)
+        loc11[i] = (uint8_t) (i * 7 + i / 13);
+    size_t loads3[4][2] = { { 100, 1000 }, { 1500, 333 }, { 2000, 17 }, { 4000, 96 } };
+    uint8_t flat2[4096];
+    for (size_t step = 0; step < 5; step++) {
+        if (step > 0) {
+            ret = sb_load_range(r, loads3[step - 1][0], &loc11[step], loads3[step - 1][1], &err);
+            if (ret < 0) {
+                printf("Failed to load range: %s\n", err.error);
+                return 1;
+            }
+        }
+
+        ret = sb_seek(r, 0, SB_SET, &pos, &err);
+        if (ret < 0 || sb_read(r, &flat2[0], 4096, &err) != 4096) {
+            printf("Failed to read sparsebuffer: %s\n", err.error);
+            return 1;
+        }
+
+        size_t spans2[5][2] = { { 0, 4096 }, { 0, 4096 }, { 50, 1200 }, { 1600, 2000 }, { 1999, 19 } };
+        for (size_t i = 0; i < 5; i++) {
+            ret = sb_hash(r, spans2[i][0], spans2[i][1], SB_HASH_CRC32C, &hash, &err);
+            if (ret < 0) {
+                printf("Failed to hash: %s\n", err.error);
+                return 1;
+            }
+            if (hash != ref_crc32c(&flat2[spans2[i][0]], spans2[i][1])) {
+                printf("Bad CRC32C for [%zu, +%zu) after %zu loads.\n", spans2[i][0], spans2[i][1], step);
+                return 1;
+            }
+        }
+    }
+
+    sb_free_reader(&r);
+
+    r = sb_new_reader_custom_alloc(5 * 4096, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+
+    sb_set_stream_threshold(r, 100);
+
+    ret = sb_load_range(r, 300, &loc11[0], 1000, &err);
+    if (ret == 0)
+        ret = sb_load_range(r, 4 * 4096 + 1, &loc11[0], 10, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+
+    uint8_t *expected7 = malloc(5 * 4096);
+    SBReadBuffer *rbuf = sb_alloc_read_buffer(5 * 4096, &err);
+    if (expected7 == NULL || rbuf == NULL) {
+        printf("Failed to allocate read buffers.\n");
+        return 1;
+    }
+    memset(expected7, 0xFF, 5 * 4096);
+    uint8_t *mapped = sb_read_buffer_data(rbuf);
+    memset(mapped, 0xFF, 5 * 4096);
+
+    ret = sb_seek(r, 0, SB_SET, &pos, &err);
+    if (ret < 0 || sb_read(r, expected7, 5 * 4096, &err) != 5 * 4096) {
+        printf("Failed to read sparsebuffer: %s\n", err.error);
+        return 1;
+    }
+    for (size_t i = 0; i < 5 * 4096; i++) {
+        uint8_t want = i >= 300 && i < 1300 ? loc11[i - 300] : i > 4 * 4096 && i <= 4 * 4096 + 10 ? loc11[i - 4 * 4096 - 1] : 0;
+        if (expected7[i] != want) {
+            printf("Expected %"PRIu8" at pos %zu, but got %"PRIu8".\n", want, i, expected7[i]);
+            return 1;
+        }
+    }
+
+    ret = sb_seek(r, 7, SB_SET, &pos, &err);
+    if (ret < 0 || sb_read_remap(r, rbuf, 7, 5 * 4096 - 7, &err) != 5 * 4096 - 7) {
+        printf("Failed to read sparsebuffer: %s\n", err.error);
+        return 1;
+    }
+    if (memcmp(mapped + 7, expected7 + 7, 5 * 4096 - 7) || mapped[6] != 0xFF) {
+        printf("Remapped read does not match.\n");
+        return 1;
+    }
+
+    if (sb_seek(r, 0, SB_SET, &pos, &err) < 0 || sb_read_remap(r, rbuf, 8, 5 * 4096 - 7, &err) != 0) {
+        printf("Remapped read past the end of its buffer.\n");
+        return 1;
+    }
+
+    sb_free_read_buffer(&rbuf);
+    free(expected7);
+
+    sb_free_reader(&r);
+
+    r = sb_new_reader_custom_alloc(64, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+
+    ret = sb_load_range(r, 8, &loc9[0], 16, &err);
+    if (ret == 0)
+        ret = sb_load_range(r, 40, &loc9[0], 8, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+
+    SBReader *v = sb_new_view(r, 10, 40, &err);
+    if (v == NULL) {
+        printf("Failed to make new view: %s\n", err.error);
+        return 1;
+    }
+    SBReader *vv = sb_new_view(v, 2, 10, &err);
+    if (vv == NULL) {
+        printf("Failed to make new view: %s\n", err.error);
+        return 1;
+    }
+    if (sb_new_view(v, 2, 39, &err) != NULL) {
+        printf("Made a view past the end of its parent.\n");
+        return 1;
+    }
+
+    uint32_t v32;
+    uint8_t v8;
+    if (sb_size(v) != 40 || sb_read_u32be(v, &v32, &err) < 0 || v32 != 0x12131415) {
+        printf("Bad view read.\n");
+        return 1;
+    }
+    if (sb_read_u8(vv, &v8, &err) < 0 || v8 != 0x14) {
+        printf("Bad nested view read.\n");
+        return 1;
+    }
+    if (sb_load_range(v, 0, &loc9[0], 1, &err) == 0) {
+        printf("Loaded a range into a view.\n");
+        return 1;
+    }
+
+    uint8_t viewbuf[40];
+    ret = sb_seek(r, 10, SB_SET, &pos, &err);
+    if (ret < 0 || sb_read(r, &buf[0], 40, &err) != 40 || sb_seek(v, 0, SB_SET, &pos, &err) < 0 ||
+        sb_read(v, &viewbuf[0], 40, &err) != 40 || memcmp(&buf[0], &viewbuf[0], 40)) {
+        printf("View read does not match its parent.\n");
+        return 1;
+    }
+    if (sb_read(v, &viewbuf[0], 1, &err) == 1) {
+        printf("Read past the end of a view.\n");
+        return 1;
+    }
+
+    ret = sb_missing_ranges(v, 0, 40, &holes[0], 4, 0, &nbholes, &err);
+    if (ret < 0 || nbholes != 2 || holes[0].pos != 14 || holes[0].size != 16 || holes[1].pos != 38 || holes[1].size != 2) {
+        printf("Bad missing ranges in a view.\n");
+        return 1;
+    }
+
+    size_t found;
+    ret = sb_find(v, 0, 40, &loc9[5], 2, &found, &err);
+    if (ret != 1 || found != 3) {
+        printf("Bad search in a view.\n");
+        return 1;
+    }
+
+    uint64_t hash2;
+    ret = sb_hash(r, 10, 40, SB_HASH_CRC32C, &hash, &err);
+    if (ret == 0)
+        ret = sb_hash(v, 0, 40, SB_HASH_CRC32C, &hash2, &err);
+    if (ret < 0 || hash != hash2) {
+        printf("Bad hash of a view.\n");
+        return 1;
+    }
+
+    /* Loading into the parent must be visible through a view already reading from the same range. */
+    uint8_t patch[4] = { 0xAA, 0xAA, 0xAA, 0xAA };
+    ret = sb_seek(v, 12, SB_SET, &pos, &err);
+    if (ret < 0 || sb_read_u8(v, &v8, &err) < 0 || v8 != 0x1E) {
+        printf("Bad view read.\n");
+        return 1;
+    }
+    ret = sb_load_range(r, 23, &patch[0], 4, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+    if (sb_read_u8(v, &v8, &err) < 0 || v8 != 0xAA) {
+        printf("View read stale data after its parent changed.\n");
+        return 1;
+    }
+
+    /* Reassemble the view from its extents. */
+    SBRangeIter it;
+    ret = sb_range_iter_init(&it, v, 0, 40, &err);
+    if (ret < 0) {
+        printf("Failed to init range iterator: %s\n", err.error);
+        return 1;
+    }
+    ret = sb_seek(v, 0, SB_SET, &pos, &err);
+    if (ret < 0 || sb_read(v, &buf[0], 40, &err) != 40) {
+        printf("Failed to read view: %s\n", err.error);
+        return 1;
+    }
+    SBRange ext;
+    const uint8_t *extdata;
+    size_t next = 0, nbloaded = 0;
+    memset(&viewbuf[0], 0xFF, 40);
+    while (sb_range_iter_next(&it, &ext, &extdata) == 1) {
+        if (ext.pos != next || ext.size == 0) {
+            printf("Range iterator skipped from %zu to %zu.\n", next, ext.pos);
+            return 1;
+        }
+        if (extdata != NULL) {
+            memcpy(&viewbuf[ext.pos], extdata, ext.size);
+            nbloaded++;
+        } else {
+            memset(&viewbuf[ext.pos], 0, ext.size);
+        }
+        next = ext.pos + ext.size;
+    }
+    if (next != 40 || nbloaded != 2 || memcmp(&buf[0], &viewbuf[0], 40)) {
+        printf("Range iterator extents do not match the view.\n");
+        return 1;
+    }
+
+    sb_free_reader(&vv);
+    sb_free_reader(&v);
+    sb_free_reader(&r);
+
+    r = sb_new_reader_custom_alloc(4096, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+
+    /* Interleave reads from two cursors, with the ranges changing between them. */
+    uint8_t cflat[4096] = { 0 };
+    for (size_t i = 0; i < 32; i++) {
+        size_t off = i * 128 + (i % 5) * 7, len = 40 + (i % 3) * 30;
+        uint8_t chunk[128];
+        for (size_t j = 0; j < len; j++)
+            chunk[j] = cflat[off + j] = pattern(off + j);
+        ret = sb_load_range(r, off, &chunk[0], len, &err);
+        if (ret < 0) {
+            printf("Failed to load range: %s\n", err.error);
+            return 1;
+        }
+    }
+
+    SBCursor cur1, cur2;
+    sb_cursor_init(&cur1, r);
+    sb_cursor_init(&cur2, r);
+    ret = sb_cursor_seek(&cur2, 1000, SB_END, &pos, &err);
+    if (ret < 0 || pos != 3096) {
+        printf("Bad cursor seek.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < 40; i++) {
+        uint8_t buf1[100], buf2[100];
+        size_t p1 = sb_cursor_tell(&cur1), p2 = sb_cursor_tell(&cur2);
+
+        if (sb_cursor_read(&cur1, &buf1[0], 97, &err) != 97 || sb_cursor_read(&cur2, &buf2[0], 23, &err) != 23) {
+            printf("Failed to read cursor: %s\n", err.error);
+            return 1;
+        }
+        if (memcmp(&buf1[0], &cflat[p1], 97) != 0 || memcmp(&buf2[0], &cflat[p2], 23) != 0) {
+            printf("Cursor read does not match at %zu and %zu.\n", p1, p2);
+            return 1;
+        }
+
+        if (i % 7 == 3) {
+            ret = sb_remove_range(r, p1 + 200, p1 + 219, &err);
+        } else if (i % 7 == 5) {
+            ret = sb_load_range(r, p2 + 50, &cflat[p2], 10, &err);
+        }
+        if (ret < 0) {
+            printf("Failed to change ranges: %s\n", err.error);
+            return 1;
+        }
+        if (i % 7 == 3 || i % 7 == 5) {
+            ret = sb_seek(r, 0, SB_SET, &pos, &err);
+            if (ret < 0 || sb_read(r, &cflat[0], 4096, &err) != 4096) {
+                printf("Failed to read sparsebuffer: %s\n", err.error);
+                return 1;
+            }
+        }
+
+        /* Seek the second cursor backwards now and then. */
+        if (i % 4 == 1)
+            ret = sb_cursor_seek(&cur2, (size_t) -300, SB_CUR, &pos, &err);
+        if (ret < 0) {
+            printf("Bad cursor seek: %s\n", err.error);
+            return 1;
+        }
+    }
+    if (sb_cursor_tell(&cur1) != 3880) {
+        printf("Bad cursor position.\n");
+        return 1;
+    }
+    ret = sb_cursor_seek(&cur1, 1, SB_END, &pos, &err);
+    if (ret == 0 && sb_cursor_read(&cur1, &cflat[0], 2, &err) == 2) {
+        printf("Cursor read past EOF.\n");
+        return 1;
+    }
+
+    /* A cursor over a view. */
+    SBReader *cv = sb_new_view(r, 1000, 500, &err);
+    if (cv == NULL) {
+        printf("Failed to make new view: %s\n", err.error);
+        return 1;
+    }
+    sb_cursor_init(&cur1, cv);
+    uint8_t vbuf[500];
+    if (sb_cursor_read(&cur1, &vbuf[0], 300, &err) != 300 || sb_cursor_read(&cur1, &vbuf[300], 200, &err) != 200 ||
+        memcmp(&vbuf[0], &cflat[1000], 500) != 0) {
+        printf("Bad cursor read from a view.\n");
+        return 1;
+    }
+    if (sb_cursor_seek(&cur1, 501, SB_SET, &pos, &err) == 0) {
+        printf("Seeked a cursor past the end of a view.\n");
+        return 1;
+    }
+    sb_free_reader(&cv);
+    sb_free_reader(&r);
+
+    /* Lock-free reads must see the same data as locked ones, through every kind of change. */
+    SBReader *lr = sb_new_reader_flags(4096, SB_LOCK_FREE_READS, test_alloc, test_realloc, test_free, &err);
+    r            = sb_new_reader_custom_alloc(4096, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL || lr == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    unsigned int lseed = 7;
+    for (int i = 0; i < 300; i++) {
+        size_t off = lcg(&lseed) % 3584, len = 1 + lcg(&lseed) % 512, op = lcg(&lseed) % 16;
+        uint8_t chunk[512], got[4096], want[4096];
+        int ret1, ret2;
+
+        if (op == 0) {
+            sb_clear(r);
+            sb_clear(lr);
+            ret1 = ret2 = 0;
+        } else if (op == 1) {
+            ret1 = sb_resize(r, 3584 + off / 7, &err);
+            ret2 = sb_resize(lr, 3584 + off / 7, &err);
+        } else if (op < 6) {
+            ret1 = sb_remove_range(r, off, off + len - 1, &err);
+            ret2 = sb_remove_range(lr, off, off + len - 1, &err);
+        } else {
+            for (size_t j = 0; j < len; j++)
+                chunk[j] = (uint8_t) lcg(&lseed);
+            ret1 = sb_load_range(r, off, &chunk[0], len, &err);
+            ret2 = sb_load_range(lr, off, &chunk[0], len, &err);
+        }
+        if ((ret1 < 0) != (ret2 < 0)) {
+            printf("Lock-free reader change did not match: %s\n", err.error);
+            return 1;
+        }
+
+        size_t size = sb_size(r);
+        SBCursor lcur;
+        sb_cursor_init(&lcur, lr);
+        if (sb_size(lr) != size || sb_seek(r, 0, SB_SET, &pos, &err) < 0 || sb_read(r, &want[0], size, &err) != size ||
+            sb_cursor_read(&lcur, &got[0], size, &err) != size || memcmp(&got[0], &want[0], size) != 0 ||
+            sb_cursor_read(&lcur, &got[0], 1, &err) == 1) {
+            printf("Lock-free read does not match after %d changes.\n", i);
+            return 1;
+        }
+    }
+    sb_free_reader(&lr);
+    sb_free_reader(&r);
+
+    /* Sparse mapped readers must see the same data and holes as others, through every kind of change. */
+    for (int k = 0; k < 2; k++) {
+        int sflags = SB_SPARSE_MAP | (k == 0 ? 0 : SB_THREAD_SAFE);
+        SBReader *sr = sb_new_reader_flags(4096, sflags, test_alloc, test_realloc, test_free, &err);
+        r            = sb_new_reader_custom_alloc(4096, test_alloc, test_realloc, test_free, &err);
+        if (r == NULL || sr == NULL) {
+            printf("Failed to make new reader: %s\n", err.error);
+            return 1;
+        }
+        if (sb_snapshot(sr, &err) != NULL || sb_clone_reader(sr, &err) != NULL ||
+            sb_new_reader_flags(4096, SB_SPARSE_MAP | SB_LOCK_FREE_READS, NULL, NULL, NULL, &err) != NULL) {
+            printf("Sparse mapped reader allowed sharing.\n");
+            return 1;
+        }
+        uint8_t wrap[100] = { 0 };
+        if (sb_load_range(sr, SIZE_MAX - 10, &wrap[0], 100, &err) == 0 ||
+            sb_load_range(r, SIZE_MAX - 10, &wrap[0], 100, &err) == 0) {
+            printf("Loaded a range wrapping past the end of the address space.\n");
+            return 1;
+        }
+
+        /* A removal which fails to split a range leaves its data in place. */
+        SBReader *fr = sb_new_reader_flags(4096, sflags, flaky_alloc, test_realloc, test_free, &err);
+        uint8_t fdata[200], fgot[200];
+        for (size_t j = 0; j < 200; j++)
+            fdata[j] = pattern(j);
+        if (fr == NULL || sb_load_range(fr, 100, &fdata[0], 200, &err) < 0) {
+            printf("Failed to load range: %s\n", err.error);
+            return 1;
+        }
+        alloc_fail = 1;
+        ret        = sb_remove_range(fr, 150, 199, &err);
+        alloc_fail = 0;
+        if (ret == 0 || sb_seek(fr, 100, SB_SET, &pos, &err) < 0 || sb_read(fr, &fgot[0], 200, &err) != 200 ||
+            memcmp(&fgot[0], &fdata[0], 200) != 0) {
+            printf("Failed removal changed sparse mapped data.\n");
+            return 1;
+        }
+        sb_free_reader(&fr);
+        unsigned int sseed = 11;
+        for (int i = 0; i < 300; i++) {
+            size_t off = lcg(&sseed) % 3584, len = 1 + lcg(&sseed) % 512, op = lcg(&sseed) % 16;
+            uint8_t chunk[512], got[8192], want[8192];
+            int ret1, ret2;
+
+            if (op == 0) {
+                sb_clear(r);
+                sb_clear(sr);
+                ret1 = ret2 = 0;
+            } else if (op == 1) {
+                ret1 = sb_resize(r, 3584 + off, &err);
+                ret2 = sb_resize(sr, 3584 + off, &err);
+            } else if (op < 6) {
+                ret1 = sb_remove_range(r, off, off + len - 1, &err);
+                ret2 = sb_remove_range(sr, off, off + len - 1, &err);
+            } else {
+                for (size_t j = 0; j < len; j++)
+                    chunk[j] = (uint8_t) lcg(&sseed);
+                ret1 = sb_load_range(r, off, &chunk[0], len, &err);
+                ret2 = sb_load_range(sr, off, &chunk[0], len, &err);
+            }
+            if ((ret1 < 0) != (ret2 < 0)) {
+                printf("Sparse mapped reader change did not match: %s\n", err.error);
+                return 1;
+            }
+
+            size_t size = sb_size(r);
+            SBRange holes1[64], holes2[64];
+            size_t nholes1, nholes2;
+            if (sb_size(sr) != size || sb_seek(r, 0, SB_SET, &pos, &err) < 0 || sb_read(r, &want[0], size, &err) != size ||
+                sb_seek(sr, 0, SB_SET, &pos, &err) < 0 || sb_read(sr, &got[0], size, &err) != size ||
+                memcmp(&got[0], &want[0], size) != 0 ||
+                sb_missing_ranges(r, 0, size, &holes1[0], 64, 0, &nholes1, &err) < 0 ||
+                sb_missing_ranges(sr, 0, size, &holes2[0], 64, 0, &nholes2, &err) < 0 || nholes1 != nholes2 ||
+                memcmp(&holes1[0], &holes2[0], (nholes1 < 64 ? nholes1 : 64) * sizeof(SBRange)) != 0) {
+                printf("Sparse mapped read does not match after %d changes.\n", i);
+                return 1;
+            }
+
+            /* Byte at a time, through the window, from a view. */
+            SBReader *sv = sb_new_view(sr, off / 2, size - off / 2, &err);
+            if (sv == NULL) {
+                printf("Failed to make view: %s\n", err.error);
+                return 1;
+            }
+            for (size_t j = off / 2; j < size; j += 97) {
+                uint8_t b;
+                if (sb_seek(sv, j - off / 2, SB_SET, &pos, &err) < 0 || sb_read_u8(sv, &b, &err) < 0 || b != want[j]) {
+                    printf("Sparse mapped view read does not match after %d changes.\n", i);
+                    return 1;
+                }
+            }
+            sb_free_reader(&sv);
+        }
+        sb_free_reader(&sr);
+        sb_free_reader(&r);
+    }
+
+    /* Snapshots must not see later changes to their reader. */
+    for (int k = 0; k < 2; k++) {
+        r = sb_new_reader_flags(4096, k == 0 ? 0 : SB_THREAD_SAFE, test_alloc, test_realloc, test_free, &err);
+        if (r == NULL) {
+            printf("Failed to make new reader: %s\n", err.error);
+            return 1;
+        }
+        uint8_t snapwant[4096] = { 0 }, snapgot[4096], chunk[512];
+        for (size_t i = 0; i < 8; i++) {
+            size_t off = i * 500 + 17;
+            for (size_t j = 0; j < 300; j++)
+                chunk[j] = snapwant[off + j] = pattern(off + j);
+            if (sb_load_range(r, off, &chunk[0], 300, &err) < 0) {
+                printf("Failed to load range: %s\n", err.error);
+                return 1;
+            }
+        }
+        SBReader *snap = sb_snapshot(r, &err);
+        if (snap == NULL) {
+            printf("Failed to take snapshot: %s\n", err.error);
+            return 1;
+        }
+
+        SnapTest snt = { snap, &snapwant[0], 0 };
+        pthread_t snthread;
+        if (k == 1 && pthread_create(&snthread, NULL, snap_thread, &snt) != 0) {
+            printf("Failed to create thread.\n");
+            return 1;
+        }
+
+        memset(&chunk[0], 0xEE, 512);
+        ret = sb_load_range(r, 200, &chunk[0], 512, &err);
+        if (ret == 0)
+            ret = sb_remove_range(r, 1000, 2100, &err);
+        SBReader *snap2 = ret == 0 ? sb_snapshot(r, &err) : NULL;
+        if (snap2 == NULL) {
+            printf("Failed to change reader: %s\n", err.error);
+            return 1;
+        }
+        ret = sb_resize(r, 3000, &err);
+        sb_clear(r);
+        if (ret == 0)
+            ret = sb_load_range(r, 0, &chunk[0], 512, &err);
+        if (ret < 0) {
+            printf("Failed to change reader: %s\n", err.error);
+            return 1;
+        }
+
+        if (k == 1) {
+            pthread_join(snthread, NULL);
+            if (snt.failed) {
+                printf("Snapshot changed while reading.\n");
+                return 1;
+            }
+        }
+        if (sb_seek(snap, 0, SB_SET, &pos, &err) < 0 || sb_read(snap, &snapgot[0], 4096, &err) != 4096 ||
+            memcmp(&snapgot[0], &snapwant[0], 4096) != 0) {
+            printf("Snapshot changed.\n");
+            return 1;
+        }
+        if (sb_load_range(snap, 0, &chunk[0], 10, &err) == 0 || sb_remove_range(snap, 0, 10, &err) == 0 ||
+            sb_resize(snap, 10, &err) == 0) {
+            printf("Modified a snapshot.\n");
+            return 1;
+        }
+        sb_clear(snap);
+
+        /* A snapshot of a snapshot outlives both. */
+        SBReader *snap3 = sb_snapshot(snap, &err);
+        if (snap3 == NULL) {
+            printf("Failed to take snapshot: %s\n", err.error);
+            return 1;
+        }
+        sb_free_reader(&snap);
+        sb_free_reader(&r);
+        if (sb_read(snap3, &snapgot[0], 4096, &err) != 4096 || memcmp(&snapgot[0], &snapwant[0], 4096) != 0) {
+            printf("Snapshot of a snapshot changed.\n");
+            return 1;
+        }
+        memcpy(&snapwant[200], &chunk[0], 512);
+        memset(&snapwant[1000], 0, 1101);
+        if (sb_read(snap2, &snapgot[0], 4096, &err) != 4096 || memcmp(&snapgot[0], &snapwant[0], 4096) != 0) {
+            printf("Second snapshot changed.\n");
+            return 1;
+        }
+        sb_free_reader(&snap3);
+        sb_free_reader(&snap2);
+    }
+
+    /* Loading from a file matches loading the same bytes from memory. */
+    {
+        char path[] = "/tmp/sbtestXXXXXX";
+        int fd      = mkstemp(&path[0]);
+        if (fd < 0) {
+            printf("Failed to make temporary file.\n");
+            return 1;
+        }
+        unlink(&path[0]);
+        uint8_t file[4096];
+        for (size_t j = 0; j < 4096; j++)
+            file[j] = pattern(j * 7);
+        if (write(fd, &file[0], 4096) != 4096) {
+            printf("Failed to write temporary file.\n");
+            return 1;
+        }
+
+        /* Fresh, appended, overlapping, contained and bridging loads. */
+        size_t loads[][3] = {
+            { 100, 0, 200 }, { 300, 200, 300 }, { 600, 1000, 50 }, { 1000, 3000, 500 },
+            { 900, 50, 150 }, { 1200, 10, 20 }, { 1500, 500, 100 }, { 0, 4000, 96 },
+        };
+        int fflags[2] = { 0, SB_THREAD_SAFE };
+        for (int k = 0; k < 2; k++) {
+            SBReader *want = sb_new_reader(2048, &err);
+            r              = sb_new_reader_flags(2048, fflags[k], test_alloc, test_realloc, test_free, &err);
+            if (want == NULL || r == NULL) {
+                printf("Failed to make new reader: %s\n", err.error);
+                return 1;
+            }
+            for (size_t j = 0; j < sizeof(loads) / sizeof(loads[0]); j++) {
+                if (sb_load_from_fd(r, loads[j][0], fd, loads[j][1], loads[j][2], &err) < 0 ||
+                    sb_load_range(want, loads[j][0], &file[loads[j][1]], loads[j][2], &err) < 0) {
+                    printf("Failed to load from file: %s\n", err.error);
+                    return 1;
+                }
+                uint8_t a[2048], b[2048];
+                if (sb_seek(r, 0, SB_SET, &pos, &err) < 0 || sb_seek(want, 0, SB_SET, &pos, &err) < 0 ||
+                    sb_read(r, &a[0], 2048, &err) != 2048 || sb_read(want, &b[0], 2048, &err) != 2048 ||
+                    memcmp(&a[0], &b[0], 2048) != 0) {
+                    printf("File load %zu does not match.\n", j);
+                    return 1;
+                }
+            }
+
+            /* Reads past the end of the file, or the reader, load nothing. */
+            SBRange missing[4];
+            size_t nmissing;
+            if (sb_load_from_fd(r, 1700, fd, 4090, 10, &err) == 0 ||
+                sb_load_from_fd(r, 2040, fd, 0, 10, &err) == 0 ||
+                sb_missing_ranges(r, 1700, 348, &missing[0], 4, 0, &nmissing, &err) < 0 ||
+                nmissing != 1 || missing[0].pos != 1700) {
+                printf("Failed file loads changed the reader.\n");
+                return 1;
+            }
+            sb_free_reader(&want);
+            sb_free_reader(&r);
+        }
+
+        /* Batches larger than the ring, with every method, match loading one at a time. */
+        SBLoadJob jobs[150];
+        for (size_t j = 0; j < 150; j++) {
+            jobs[j].pos      = (j * 37) % 1900;
+            jobs[j].fd       = fd;
+            jobs[j].file_off = (j * 101) % 4000;
+            jobs[j].len      = 1 + j % 48;
+        }
+        SBLoadMethod methods[3] = { SB_LOAD_ANY, SB_LOAD_PREAD, SB_LOAD_IO_URING };
+        int bflags[2]           = { 0, SB_LOCK_FREE_READS };
+        for (int m = 0; m < 3; m++) {
+            for (int k = 0; k < 2; k++) {
+                SBReader *want = sb_new_reader(2048, &err);
+                r              = sb_new_reader_flags(2048, bflags[k], test_alloc, test_realloc, test_free, &err);
+                if (want == NULL || r == NULL) {
+                    printf("Failed to make new reader: %s\n", err.error);
+                    return 1;
+                }
+                ret = sb_load_batch(r, &jobs[0], 150, methods[m], &err);
+                if (ret < 0 && methods[m] == SB_LOAD_IO_URING && strcmp(err.error, "io_uring is not available.") == 0) {
+                    sb_free_reader(&want);
+                    sb_free_reader(&r);
+                    continue;
+                } else if (ret < 0) {
+                    printf("Failed to load batch: %s\n", err.error);
+                    return 1;
+                }
+                for (size_t j = 0; j < 150; j++) {
+                    if (sb_load_range(want, jobs[j].pos, &file[jobs[j].file_off], jobs[j].len, &err) < 0) {
+                        printf("Failed to load range: %s\n", err.error);
+                        return 1;
+                    }
+                }
+                uint8_t a[2048], b[2048];
+                if (sb_seek(r, 0, SB_SET, &pos, &err) < 0 || sb_seek(want, 0, SB_SET, &pos, &err) < 0 ||
+                    sb_read(r, &a[0], 2048, &err) != 2048 || sb_read(want, &b[0], 2048, &err) != 2048 ||
+                    memcmp(&a[0], &b[0], 2048) != 0) {
+                    printf("Batch load with method %d does not match.\n", m);
+                    return 1;
+                }
+
+                /* A bad job fails the whole batch, loading nothing. */
+                SBLoadJob bad[3] = { { 2010, fd, 0, 10 }, { 2020, fd, 4090, 10 }, { 2030, -1, 0, 10 } };
+                SBRange missing[4];
+                size_t nmissing;
+                if (sb_load_batch(r, &bad[0], 2, methods[m], &err) == 0 ||
+                    sb_load_batch(r, &bad[0], 3, methods[m], &err) == 0 ||
+                    sb_missing_ranges(r, 2010, 38, &missing[0], 4, 0, &nmissing, &err) < 0 ||
+                    nmissing != 1 || missing[0].pos != 2010 || missing[0].size != 38) {
+                    printf("Failed batch load changed the reader.\n");
+                    return 1;
+                }
+                sb_free_reader(&want);
+                sb_free_reader(&r);
+            }
+        }
+
+        /* Mapped loads, mixed with copies and removals, match loading the same bytes from memory. */
+        for (int k = 0; k < 2; k++) {
+            SBReader *want = sb_new_reader(2048, &err);
+            r              = sb_new_reader_flags(2048, bflags[k], test_alloc, test_realloc, test_free, &err);
+            if (want == NULL || r == NULL) {
+                printf("Failed to make new reader: %s\n", err.error);
+                return 1;
+            }
+            if (sb_load_mapped(r, 0, 0, 10, &err) == 0 || sb_map_file(r, fd, &err) < 0 ||
+                sb_map_file(r, fd, &err) == 0 || sb_load_mapped(r, 0, 4090, 10, &err) == 0) {
+                printf("Failed to map file.\n");
+                return 1;
+            }
+
+            /* { op, pos, file offset or end, len }: 0 maps, 1 copies, 2 removes. */
+            size_t ops[][4] = {
+                { 0, 100, 1000, 200 }, { 0, 300, 1200, 100 }, { 0, 500, 0, 300 }, { 2, 150, 199, 0 },
+                { 2, 550, 560, 0 },    { 2, 780, 799, 0 },     { 1, 390, 3000, 20 }, { 0, 120, 50, 10 },
+                { 0, 1500, 2000, 300 }, { 0, 1450, 10, 400 },  { 2, 1000, 1600, 0 }, { 0, 900, 900, 30 },
+            };
+            for (size_t j = 0; j < sizeof(ops) / sizeof(ops[0]); j++) {
+                size_t *op = &ops[j][0];
+                if (op[0] == 0)
+                    ret = sb_load_mapped(r, op[1], op[2], op[3], &err);
+                else if (op[0] == 1)
+                    ret = sb_load_range(r, op[1], &file[op[2]], op[3], &err);
+                else
+                    ret = sb_remove_range(r, op[1], op[2], &err);
+                if (ret == 0 && op[0] == 2)
+                    ret = sb_remove_range(want, op[1], op[2], &err);
+                else if (ret == 0)
+                    ret = sb_load_range(want, op[1], &file[op[2]], op[3], &err);
+                if (ret < 0) {
+                    printf("Failed mapped op %zu: %s\n", j, err.error);
+                    return 1;
+                }
+                uint8_t a[2048], b[2048];
+                if (sb_seek(r, 0, SB_SET, &pos, &err) < 0 || sb_seek(want, 0, SB_SET, &pos, &err) < 0 ||
+                    sb_read(r, &a[0], 2048, &err) != 2048 || sb_read(want, &b[0], 2048, &err) != 2048 ||
+                    memcmp(&a[0], &b[0], 2048) != 0) {
+                    printf("Mapped op %zu does not match.\n", j);
+                    return 1;
+                }
+            }
+
+            /* Mapped ranges read the file itself, and clones keep the mapping after the source is gone. */
+            SBReader *clone = sb_clone_reader(r, &err);
+            if (clone == NULL) {
+                printf("Failed to clone reader: %s\n", err.error);
+                return 1;
+            }
+            sb_free_reader(&r);
+            uint8_t before, after, changed = (uint8_t) ~file[100];
+            if (sb_seek(clone, 600, SB_SET, &pos, &err) < 0 || sb_read(clone, &before, 1, &err) != 1 ||
+                pwrite(fd, &changed, 1, 100) != 1 || sb_seek(clone, 600, SB_SET, &pos, &err) < 0 ||
+                sb_read(clone, &after, 1, &err) != 1 || pwrite(fd, &file[100], 1, 100) != 1 ||
+                before != file[100] || after != changed) {
+                printf("Mapped range does not read the file.\n");
+                return 1;
+            }
+            sb_free_reader(&clone);
+            sb_free_reader(&want);
+        }
+        close(fd);
+    }
+
+    /* Spilled readers keep their data, and no more than the limit in memory. */
+    int spflags[2] = { 0, SB_LOCK_FREE_READS };
+    for (int k = 0; k < 2; k++) {
+        SBReader *want = sb_new_reader(65536, &err);
+        r              = sb_new_reader_flags(65536, spflags[k], test_alloc, test_realloc, test_free, &err);
+        if (want == NULL || r == NULL) {
+            printf("Failed to make new reader: %s\n", err.error);
+            return 1;
+        }
+        if (sb_set_spill(r, "/nonexistent/dir", 8192, &err) == 0 || sb_set_spill(r, "/tmp", 8192, &err) < 0) {
+            printf("Failed to set spill directory.\n");
+            return 1;
+        }
+
+        uint8_t chunk[1000], hot[1000];
+        for (size_t i = 0; i < 32; i++) {
+            for (size_t j = 0; j < 1000; j++)
+                chunk[j] = pattern(i * 131 + j);
+            if (sb_load_range(r, i * 2000, &chunk[0], 1000, &err) < 0 ||
+                sb_load_range(want, i * 2000, &chunk[0], 1000, &err) < 0) {
+                printf("Failed to load range: %s\n", err.error);
+                return 1;
+            }
+            if (sb_resident_size(r) > 8192) {
+                printf("Spilled reader holds %zu bytes.\n", sb_resident_size(r));
+                return 1;
+            }
+
+            /* Keep the first range in use, so it is never the coldest. */
+            if (sb_seek(r, 0, SB_SET, &pos, &err) < 0 || sb_read(r, &hot[0], 1000, &err) != 1000) {
+                printf("Failed to read: %s\n", err.error);
+                return 1;
+            }
+        }
+
+        /* Only the range kept in use should still be in memory. */
+        SBReader *hotc = sb_clone_reader(r, &err);
+        if (hotc == NULL || sb_remove_range(hotc, 1000, 65535, &err) < 0 || sb_resident_size(hotc) != 1000) {
+            printf("Spilled the wrong ranges.\n");
+            return 1;
+        }
+        sb_free_reader(&hotc);
+
+        /* Merge and split spilled ranges with ones in memory. */
+        memset(&chunk[0], 0xAB, 1000);
+        if (sb_load_range(r, 2500, &chunk[0], 1000, &err) < 0 || sb_load_range(want, 2500, &chunk[0], 1000, &err) < 0 ||
+            sb_remove_range(r, 10100, 10199, &err) < 0 || sb_remove_range(want, 10100, 10199, &err) < 0) {
+            printf("Failed to change spilled reader: %s\n", err.error);
+            return 1;
+        }
+
+        SBReader *snap = sb_snapshot(r, &err);
+        if (snap == NULL) {
+            printf("Failed to take snapshot: %s\n", err.error);
+            return 1;
+        }
+        sb_free_reader(&r);
+
+        static uint8_t a[65536], b[65536];
+        if (sb_read(snap, &a[0], 65536, &err) != 65536 || sb_read(want, &b[0], 65536, &err) != 65536 ||
+            memcmp(&a[0], &b[0], 65536) != 0) {
+            printf("Spilled reader does not match.\n");
+            return 1;
+        }
+        sb_free_reader(&snap);
+        sb_free_reader(&want);
+    }
+
+    /* Clones change independently of their source, and of each other. */
+    int cflags[2] = { 0, SB_LOCK_FREE_READS };
+    for (int k = 0; k < 2; k++) {
+        r = sb_new_reader_flags(2048, cflags[k], test_alloc, test_realloc, test_free, &err);
+        if (r == NULL) {
+            printf("Failed to make new reader: %s\n", err.error);
+            return 1;
+        }
+        uint8_t want[3][2048] = { { 0 } }, got[2048], chunk[400];
+        for (size_t j = 0; j < 400; j++)
+            chunk[j] = pattern(j);
+        ret = sb_load_range(r, 100, &chunk[0], 400, &err);
+        if (ret == 0)
+            ret = sb_load_range(r, 1000, &chunk[0], 400, &err);
+        if (ret < 0) {
+            printf("Failed to load range: %s\n", err.error);
+            return 1;
+        }
+        memcpy(&want[0][100], &chunk[0], 400);
+        memcpy(&want[0][1000], &chunk[0], 400);
+        memcpy(&want[1][0], &want[0][0], 2048);
+        memcpy(&want[2][0], &want[0][0], 2048);
+
+        SBReader *clone = sb_clone_reader(r, &err);
+        SBReader *clone2 = clone != NULL ? sb_clone_reader(clone, &err) : NULL;
+        if (clone2 == NULL) {
+            printf("Failed to clone reader: %s\n", err.error);
+            return 1;
+        }
+
+        /* Change each differently. */
+        ret = sb_remove_range(r, 150, 1199, &err);
+        memset(&want[0][150], 0, 1050);
+        if (ret == 0)
+            ret = sb_load_range(clone, 300, &chunk[0], 400, &err);
+        memcpy(&want[1][300], &chunk[0], 400);
+        if (ret == 0)
+            ret = sb_resize(clone2, 1100, &err);
+        memset(&want[2][1100], 0, 948);
+        if (ret < 0) {
+            printf("Failed to change clones: %s\n", err.error);
+            return 1;
+        }
+
+        SBReader *readers[3] = { r, clone, clone2 };
+        for (int i = 0; i < 3; i++) {
+            size_t size = sb_size(readers[i]);
+            memset(&got[0], 0, 2048);
+            if (size != (i == 2 ? 1100 : 2048) || sb_seek(readers[i], 0, SB_SET, &pos, &err) < 0 ||
+                sb_read(readers[i], &got[0], size, &err) != size || memcmp(&got[0], &want[i][0], 2048) != 0) {
+                printf("Clone %d does not match.\n", i);
+                return 1;
+            }
+        }
+        sb_free_reader(&r);
+        sb_free_reader(&clone2);
+        sb_free_reader(&clone);
+    }
+
+    /* Copies split across workers, with a user pool and with threads. */
+    size_t psize  = (4 << 20) + 123;
+    uint8_t *pin  = malloc(psize);
+    uint8_t *pout = malloc(psize);
+    if (pin == NULL || pout == NULL) {
+        printf("Failed to allocate copy buffers.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < psize; i++)
+        pin[i] = pattern(i);
+    for (int k = 0; k < 2; k++) {
+        CountPool cp = { 0, 0 };
+        r = sb_new_reader_custom_alloc(psize + 100, test_alloc, test_realloc, test_free, &err);
+        if (r == NULL) {
+            printf("Failed to make new reader: %s\n", err.error);
+            return 1;
+        }
+        sb_set_parallel_copy(r, 1 << 20, 5, k == 0 ? count_run : NULL, &cp);
+
+        /* The second load merges the first into it. */
+        ret = sb_load_range(r, 50, &pin[0], psize - 1000, &err);
+        if (ret == 0)
+            ret = sb_load_range(r, 1050, &pin[1000], psize - 1000, &err);
+        memset(pout, 0xAA, psize);
+        if (ret < 0 || sb_seek(r, 50, SB_SET, &pos, &err) < 0 || sb_read(r, pout, psize, &err) != psize ||
+            memcmp(pout, pin, psize) != 0) {
+            printf("Bad parallel copy: %s\n", err.error);
+            return 1;
+        }
+        if (k == 0 && (cp.runs != 4 || cp.tasks != 20)) {
+            printf("Parallel copies were not split: %zu runs, %zu tasks.\n", cp.runs, cp.tasks);
+            return 1;
+        }
+
+        /* Clones keep splitting copies, with workers of their own, once the source is freed. */
+        SBReader *pc = sb_clone_reader(r, &err);
+        if (pc == NULL) {
+            printf("Failed to clone reader: %s\n", err.error);
+            return 1;
+        }
+        sb_free_reader(&r);
+        memset(pout, 0xAA, psize);
+        if (sb_seek(pc, 50, SB_SET, &pos, &err) < 0 || sb_read(pc, pout, psize, &err) != psize ||
+            memcmp(pout, pin, psize) != 0) {
+            printf("Bad parallel copy in clone: %s\n", err.error);
+            return 1;
+        }
+        sb_free_reader(&pc);
+    }
+    free(pin);
+    free(pout);
+
+    /* Notifications through callbacks and the event fd. */
+    r = sb_new_reader_custom_alloc(1024, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    SBReader *nv = sb_new_view(r, 200, 800, &err);
+    if (nv == NULL) {
+        printf("Failed to make new view: %s\n", err.error);
+        return 1;
+    }
+    int nfd = sb_notify_fd(r, &err);
+    if (nfd < 0 || sb_notify_fd(nv, &err) != nfd) {
+        printf("Failed to get event fd: %s\n", err.error);
+        return 1;
+    }
+    int ncalls = 0, na, nb, nc;
+    void *nop;
+    if (sb_notify_add(r, 100, 100, count_notify, &ncalls, &err) != 0 || sb_notify_add(nv, 100, 100, NULL, &na, &err) != 0 ||
+        sb_notify_add(r, 500, 100, NULL, &nb, &err) != 0 || sb_notify_add(r, 700, 100, NULL, &nc, &err) != 0) {
+        printf("Failed to add notification: %s\n", err.error);
+        return 1;
+    }
+    sb_notify_cancel(r, &nc);
+
+    uint8_t nbuf[256] = { 0 };
+    ret = sb_load_range(r, 0, &nbuf[0], 150, &err);
+    if (ret < 0 || ncalls != 0 || fd_readable(nfd)) {
+        printf("Notified of a partly loaded span.\n");
+        return 1;
+    }
+    ret = sb_load_range(r, 150, &nbuf[0], 100, &err);
+    if (ret == 0)
+        ret = sb_load_range(r, 700, &nbuf[0], 100, &err);
+    if (ret < 0 || ncalls != 1 || fd_readable(nfd)) {
+        printf("Bad notification callback.\n");
+        return 1;
+    }
+    ret = sb_load_range(r, 300, &nbuf[0], 100, &err);
+    if (ret < 0 || ncalls != 1 || !fd_readable(nfd) || sb_notify_next(r, &nop) != 1 || nop != &na ||
+        sb_notify_next(r, &nop) != 0 || fd_readable(nfd)) {
+        printf("Bad queued notification.\n");
+        return 1;
+    }
+    if (sb_notify_add(r, 10, 100, NULL, &na, &err) != 1) {
+        printf("Registered a loaded span.\n");
+        return 1;
+    }
+    ret = sb_resize(r, 550, &err);
+    if (ret < 0 || !fd_readable(nfd) || sb_notify_next(r, &nop) != 1 || nop != &nb || fd_readable(nfd)) {
+        printf("Not notified of a span past the end.\n");
+        return 1;
+    }
+    sb_free_reader(&nv);
+    sb_free_reader(&r);
+
+    /* Sharded readers must match unsharded ones, across shard boundaries. */
+    SBShardedReader *sr = sb_new_sharded_reader(10000, 7, test_alloc, test_realloc, test_free, &err);
+    r                   = sb_new_reader_custom_alloc(10000, test_alloc, test_realloc, test_free, &err);
+    if (sr == NULL || r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    unsigned int sseed = 11;
+    for (int i = 0; i < 400; i++) {
+        size_t off = lcg(&sseed) % 9000, len = 1 + lcg(&sseed) % 1000;
+        uint8_t chunk[1000];
+        int ret1, ret2;
+
+        if (lcg(&sseed) % 3 == 0) {
+            ret1 = sb_remove_range(r, off, off + len - 1, &err);
+            ret2 = sb_sharded_remove_range(sr, off, off + len - 1, &err);
+        } else {
+            for (size_t j = 0; j < len; j++)
+                chunk[j] = pattern(off + j);
+            ret1 = sb_load_range(r, off, &chunk[0], len, &err);
+            ret2 = sb_sharded_load_range(sr, off, &chunk[0], len, &err);
+        }
+        if (ret1 < 0 || ret2 < 0) {
+            printf("Failed to change ranges: %s\n", err.error);
+            return 1;
+        }
+
+        uint8_t got[2000], want[2000];
+        SBRange holes1[64], holes2[64];
+        size_t n1, n2, roff = lcg(&sseed) % 8000, rlen = 1 + lcg(&sseed) % 2000;
+        size_t threshold = i % 2 ? 0 : 100;
+        if (sb_seek(r, roff, SB_SET, &pos, &err) < 0 || sb_read(r, &want[0], rlen, &err) != rlen ||
+            sb_sharded_read(sr, roff, &got[0], rlen, &err) != rlen || memcmp(&got[0], &want[0], rlen) != 0) {
+            printf("Sharded read does not match after %d changes.\n", i);
+            return 1;
+        }
+        if (sb_missing_ranges(r, roff, rlen, &holes1[0], 64, threshold, &n1, &err) < 0 ||
+            sb_sharded_missing_ranges(sr, roff, rlen, &holes2[0], 64, threshold, &n2, &err) < 0 || n1 != n2 ||
+            memcmp(&holes1[0], &holes2[0], (n1 < 64 ? n1 : 64) * sizeof(SBRange)) != 0) {
+            printf("Sharded missing ranges do not match after %d changes.\n", i);
+            return 1;
+        }
+    }
+    if (sb_sharded_read(sr, 9999, &cflat[0], 2, &err) == 2 || sb_sharded_load_range(sr, 9999, &cflat[0], 2, &err) == 0) {
+        printf("Sharded reader accessed past EOF.\n");
+        return 1;
+    }
+    sb_free_sharded_reader(&sr);
+    sb_free_reader(&r);
+
+    /* A load failing in a later shard keeps the earlier shards loaded, and says which failed. */
+    sr = sb_new_sharded_reader(1000, 2, flaky_alloc, test_realloc, test_free, &err);
+    if (sr == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    for (size_t j = 0; j < 200; j++)
+        cflat[j] = pattern(j);
+    alloc_fail       = 1;
+    alloc_fail_after = 2; /* Enough for the part in the first shard. */
+    ret              = sb_sharded_load_range(sr, 400, &cflat[0], 200, &err);
+    alloc_fail       = 0;
+    if (ret == 0 || strstr(err.error, "(shard 1, at 500; shard 0 was changed)") == NULL) {
+        printf("Failed sharded load did not name the failed shard: %s\n", err.error);
+        return 1;
+    }
+    uint8_t sgot[200];
+    if (sb_sharded_read(sr, 400, &sgot[0], 200, &err) != 200 || memcmp(&sgot[0], &cflat[0], 100) != 0 ||
+        sgot[100] != 0 || sgot[199] != 0) {
+        printf("Failed sharded load did not keep only the earlier shard loaded.\n");
+        return 1;
+    }
+    sb_free_sharded_reader(&sr);
+
+    /* Parallel loads into a sharded reader. */
+    sr = sb_new_sharded_reader(20000, 4, test_alloc, test_realloc, test_free, &err);
+    if (sr == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    ShardTest st[4];
+    pthread_t sthreads[4];
+    for (int i = 0; i < 4; i++) {
+        st[i].reader = sr;
+        st[i].start  = i * 5000;
+        st[i].end    = (i + 1) * 5000;
+        st[i].failed = 0;
+        if (pthread_create(&sthreads[i], NULL, shard_thread, &st[i]) != 0) {
+            printf("Failed to create thread.\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(sthreads[i], NULL);
+        if (st[i].failed) {
+            printf("Sharded load failed.\n");
+            return 1;
+        }
+    }
+    size_t nholes;
+    SBRange shole;
+    if (sb_sharded_missing_ranges(sr, 0, 20000, &shole, 1, 0, &nholes, &err) < 0 || nholes != 0) {
+        printf("Holes left after parallel sharded loads.\n");
+        return 1;
+    }
+    for (size_t off = 0; off < 20000; off += 1000) {
+        uint8_t got[1000];
+        if (sb_sharded_read(sr, off, &got[0], 1000, &err) != 1000) {
+            printf("Failed to read sharded reader: %s\n", err.error);
+            return 1;
+        }
+        for (size_t j = 0; j < 1000; j++) {
+            if (got[j] != pattern(off + j)) {
+                printf("Bad data after parallel sharded loads at %zu.\n", off + j);
+                return 1;
+            }
+        }
+    }
+    sb_free_sharded_reader(&sr);
+
+    /* Waiting for data to be loaded. */
+    r = sb_new_reader_flags(4096, SB_THREAD_SAFE, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    uint8_t wdata[4096];
+    for (size_t i = 0; i < 4096; i++)
+        wdata[i] = pattern(i);
+
+    WaitTest wt[2];
+    pthread_t wthreads[2];
+    wt[0].reader = sb_new_view(r, 1000, 1000, &err);
+    wt[0].size   = 600;
+    wt[1].reader = sb_new_view(r, 3000, 1000, &err);
+    wt[1].size   = 500;
+    if (wt[0].reader == NULL || wt[1].reader == NULL) {
+        printf("Failed to make new view: %s\n", err.error);
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pthread_create(&wthreads[i], NULL, wait_thread, &wt[i]) != 0) {
+            printf("Failed to create thread.\n");
+            return 1;
+        }
+    }
+
+    /* Complete the first span in pieces, and shrink the reader under the second. */
+    ret = sb_load_range(r, 1000, &wdata[1000], 200, &err);
+    usleep(10000);
+    if (ret == 0)
+        ret = sb_load_range(r, 1400, &wdata[1400], 300, &err);
+    usleep(10000);
+    if (ret == 0)
+        ret = sb_load_range(r, 1150, &wdata[1150], 300, &err);
+    if (ret == 0)
+        ret = sb_resize(r, 3200, &err);
+    if (ret < 0) {
+        printf("Failed to load range: %s\n", err.error);
+        return 1;
+    }
+    for (int i = 0; i < 2; i++)
+        pthread_join(wthreads[i], NULL);
+    if (wt[0].ret != 600 || memcmp(&wt[0].buf[0], &wdata[1000], 600) != 0) {
+        printf("Bad waited read.\n");
+        return 1;
+    }
+    if (wt[1].ret == 500) {
+        printf("Waited read past EOF.\n");
+        return 1;
+    }
+
+    /* Timeouts. */
+    ret = sb_seek(wt[0].reader, 0, SB_SET, &pos, &err);
+    if (ret < 0 || sb_read_wait(wt[0].reader, &wt[0].buf[0], 800, 0, &err) == 800 ||
+        sb_read_wait(wt[0].reader, &wt[0].buf[0], 800, 20, &err) == 800) {
+        printf("Waited read did not time out.\n");
+        return 1;
+    }
+    if (sb_read_wait(wt[0].reader, &wt[0].buf[0], 700, 0, &err) != 700) {
+        printf("Failed to read loaded data: %s\n", err.error);
+        return 1;
+    }
+
+    /* Reads and seeks on the reader itself may be made while holding its shared lock. */
+    sb_lock_shared(r);
+    if (sb_seek(r, 1000, SB_SET, &pos, &err) < 0 || sb_read(r, &wt[1].buf[0], 300, &err) != 300 ||
+        sb_seek(r, 0, SB_CUR, &pos, &err) < 0 || sb_read(r, &wt[1].buf[300], 300, &err) != 300 ||
+        sb_bytes_left(r) != 1600 || memcmp(&wt[1].buf[0], &wdata[1000], 600) != 0) {
+        printf("Failed to read while holding the shared lock: %s\n", err.error);
+        return 1;
+    }
+    sb_unlock_shared(r);
+
+    /* A wait on the reader itself follows its position, when another thread moves it. */
+    WaitTest wr;
+    pthread_t wrthread;
+    wr.reader = sb_new_reader_flags(1000, SB_THREAD_SAFE, test_alloc, test_realloc, test_free, &err);
+    wr.size   = 100;
+    if (wr.reader == NULL || sb_load_range(wr.reader, 500, &wdata[500], 100, &err) < 0) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    if (pthread_create(&wrthread, NULL, wait_thread, &wr) != 0) {
+        printf("Failed to create thread.\n");
+        return 1;
+    }
+    usleep(10000);
+    if (sb_seek(wr.reader, 500, SB_SET, &pos, &err) < 0) {
+        printf("Failed to move waited reader: %s\n", err.error);
+        return 1;
+    }
+    pthread_join(wrthread, NULL);
+    if (wr.ret != 100 || memcmp(&wr.buf[0], &wdata[500], 100) != 0) {
+        printf("Waited read did not follow the position.\n");
+        return 1;
+    }
+    sb_free_reader(&wr.reader);
+
+    sb_free_reader(&wt[0].reader);
+    sb_free_reader(&wt[1].reader);
+    sb_free_reader(&r);
+
+    r = sb_new_reader_custom_alloc(64, test_alloc, test_realloc, test_free, &err);
+    if (r == NULL) {
+        printf("Failed to make new reader: %s\n", err.error);
+        return 1;
+    }
+    if (sb_read_wait(r, &wt[0].buf[0], 8, 0, &err) == 8) {
+        printf("Waited on a reader which is not thread-safe.\n");
+        return 1;
+    }
+    sb_free_reader(&r);
+
+    /* One writer and three readers, with locked and lock-free reads. */
+    int tflags[2] = { SB_THREAD_SAFE, SB_LOCK_FREE_READS };
+    for (int f = 0; f < 2; f++) {
+        r = sb_new_reader_flags(4096, tflags[f], test_alloc, test_realloc, test_free, &err);
+        if (r == NULL) {
+            printf("Failed to make new reader: %s\n", err.error);
+            return 1;
+        }
+
+        ThreadTest tt[4];
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+            tt[i].reader = r;
+            tt[i].seed   = i + 1;
+            tt[i].failed = 0;
+            if (pthread_create(&threads[i], NULL, i == 0 ? writer_thread : reader_thread, &tt[i]) != 0) {
+                printf("Failed to create thread.\n");
+                return 1;
+            }
+        }
+        for (int i = 0; i < 4; i++) {
+            pthread_join(threads[i], NULL);
+            if (tt[i].failed) {
+                printf("Thread %d failed.\n", i);
+                return 1;
+            }
+        }
+
+        sb_free_reader(&r);
+    }
+
     return 0;
 }